@@ -5,30 +5,199 @@
 */
 
 #include <bits/stdc++.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /* ---------- Utility Functions ---------- */
 
+inline bool is_blank(char c){ return c==' ' || c=='\t' || c=='\r' || c=='\n'; }
+
+// Fields are spans into the input; they are only copied when stored.
+string_view trim_view(string_view s){
+    size_t a=0, b=s.size();
+    while(a<b && is_blank(s[a])) a++;
+    while(b>a && is_blank(s[b-1])) b--;
+    return s.substr(a, b-a);
+}
+
 string trim(const string &s){
-    size_t a = s.find_first_not_of(" \t\r\n");
-    if(a==string::npos) return "";
-    size_t b = s.find_last_not_of(" \t\r\n");
-    return s.substr(a, b-a+1);
+    return string(trim_view(s));
 }
 
-vector<string> split(const string &s, char delim=','){
-    vector<string> out;
-    string cur;
+// Whether s may go into a stored text field. Snapshot and journal files
+// are split into lines before their fields are unquoted, so a field may
+// not hold a line break, nor any other control character.
+inline bool plain_text(string_view s){
+    for(unsigned char c: s)
+        if(c<0x20 || c==0x7f) return false;
+    return true;
+}
+
+// Atomic access to a plain field that sessions share, such as a stock
+// quantity kept in a copyable record or a column vector. C++20 has
+// atomic_ref for this; before it, atomic<T> of a lock-free T has the
+// same size and representation as T, which every supported compiler
+// relies on for exactly this purpose. The field must not be const; a
+// const reference is accepted so readers can take one.
+#if defined(__cpp_lib_atomic_ref)
+template<class T> atomic_ref<T> shared_ref(const T &v){
+    return atomic_ref<T>(const_cast<T&>(v));
+}
+#else
+template<class T> atomic<T>& shared_ref(const T &v){
+    static_assert(sizeof(atomic<T>)==sizeof(T) && atomic<T>::is_always_lock_free,
+                  "shared fields need a lock-free atomic of the same size");
+    return *reinterpret_cast<atomic<T>*>(const_cast<T*>(&v));
+}
+#endif
+
+/* ---------- Tokenizer ---------- */
+
+/*
+  Structural-index tokenizer: each 64-byte block is turned into bitmasks of
+  quote and delimiter positions; a prefix-XOR of the quote mask marks the
+  bytes inside quotes, and the remaining delimiter bits are the field
+  boundaries. Quotes stay part of the field and every field is trimmed,
+  exactly like the original byte-by-byte split(). Without SSE2 the scalar
+  loop is used; --selftest checks the two against each other.
+*/
+
+// The byte-by-byte tokenizer: the fallback, and the reference for the
+// vector one.
+void split_view_scalar(string_view s, char delim, vector<string_view> &out){
+    out.clear();
+    size_t start=0;
     bool inquote=false;
-    for(char c: s){
-        if(c=='\"'){ inquote=!inquote; cur.push_back(c); continue; }
-        if(c==delim && !inquote){ out.push_back(trim(cur)); cur.clear(); }
-        else cur.push_back(c);
+    for(size_t i=0;i<s.size();++i){
+        char c = s[i];
+        if(c=='\"'){ inquote=!inquote; continue; }
+        if(c==delim && !inquote){ out.push_back(trim_view(s.substr(start, i-start))); start=i+1; }
+    }
+    out.push_back(trim_view(s.substr(start)));
+}
+
+#if defined(__SSE2__)
+// Bit i is set when p[i]==c, for the 64 bytes starting at p.
+inline uint64_t match_mask64(const char* p, char c){
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi8(c);
+    uint32_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), v));
+    uint32_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+32)), v));
+    return (uint64_t)lo | ((uint64_t)hi << 32);
+#else
+    __m128i v = _mm_set1_epi8(c);
+    uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), v));
+    uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+16)), v));
+    uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+32)), v));
+    uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+48)), v));
+    return m0 | (m1<<16) | (m2<<32) | (m3<<48);
+#endif
+}
+
+// Bit i of the result is the XOR of bits 0..i of x.
+inline uint64_t prefix_xor(uint64_t x){
+    x ^= x<<1; x ^= x<<2; x ^= x<<4;
+    x ^= x<<8; x ^= x<<16; x ^= x<<32;
+    return x;
+}
+#endif
+
+void split_view(string_view s, char delim, vector<string_view> &out){
+#if defined(__SSE2__)
+    out.clear();
+    size_t start=0;
+    uint64_t carry=0;   // all ones while inside quotes across a block edge
+    auto emit = [&](size_t base, uint64_t quotes, uint64_t delims){
+        uint64_t inq = prefix_xor(quotes) ^ carry;
+        carry = (uint64_t)((int64_t)inq >> 63);
+        uint64_t seps = delims & ~inq;
+        while(seps){
+            size_t pos = base + __builtin_ctzll(seps);
+            out.push_back(trim_view(s.substr(start, pos-start)));
+            start = pos+1;
+            seps &= seps-1;
+        }
+    };
+    size_t i=0;
+    for(; i+64<=s.size(); i+=64)
+        emit(i, match_mask64(s.data()+i, '\"'), match_mask64(s.data()+i, delim));
+    if(i<s.size()){
+        char tail[64];
+        size_t n = s.size()-i;
+        memcpy(tail, s.data()+i, n);
+        memset(tail+n, 0, 64-n);
+        uint64_t live = (1ULL<<n)-1;
+        emit(i, match_mask64(tail, '\"') & live, match_mask64(tail, delim) & live);
+    }
+    out.push_back(trim_view(s.substr(start)));
+#else
+    split_view_scalar(s, delim, out);
+#endif
+}
+
+// Offset of the next '\n' at or after pos, or s.size(). memchr is
+// already vectorized by the C library.
+size_t find_newline(string_view s, size_t pos){
+    if(pos>=s.size()) return s.size();
+    const void* p = memchr(s.data()+pos, '\n', s.size()-pos);
+    return p ? (const char*)p - s.data() : s.size();
+}
+
+vector<string> split(const string &s, char delim=','){
+    vector<string_view> parts;
+    split_view(s, delim, parts);
+    return vector<string>(parts.begin(), parts.end());
+}
+
+// s as a CSV field, quoted only when it holds a delimiter, quote or newline.
+inline void put_csv(string &out, string_view s){
+    if(s.find_first_of(",\"\r\n")==string_view::npos){ out.append(s.data(), s.size()); return; }
+    out.push_back('"');
+    for(char c: s){ if(c=='"') out.push_back('"'); out.push_back(c); }
+    out.push_back('"');
+}
+
+// The value of a field written by put_csv(): enclosing quotes removed and
+// doubled quotes halved. An unquoted field is returned as it is.
+string unquote(string_view f){
+    if(f.size()<2 || f.front()!='"' || f.back()!='"') return string(f);
+    string out;
+    out.reserve(f.size()-2);
+    for(size_t i=1;i+1<f.size();++i){
+        out.push_back(f[i]);
+        if(f[i]=='"' && f[i+1]=='"') i++;
     }
-    out.push_back(trim(cur));
     return out;
 }
 
+// A whole number and nothing else, apart from surrounding blanks and a
+// leading sign. Parsed with from_chars, so no locale and no exceptions:
+// anything else, or a value out of range, returns false and leaves out
+// as it was.
+bool parse_qty(string_view s, long long &out){
+    s = trim_view(s);
+    if(s.size()>1 && s[0]=='+' && s[1]!='-') s.remove_prefix(1);
+    long long v;
+    auto r = from_chars(s.data(), s.data()+s.size(), v);
+    if(r.ec!=errc() || r.ptr!=s.data()+s.size()) return false;
+    out = v;
+    return true;
+}
+
 string join(const vector<string>& arr, char delim=','){
     string s;
     for(size_t i=0;i<arr.size();++i){
@@ -66,6 +235,271 @@ void wait_key(){
     cin.get();
 }
 
+/* ---------- JSON ---------- */
+
+// Minimal JSON reader for batch command lines. Numbers are kept as their
+// literal text so quantities can be parsed exactly as integers.
+struct Json {
+    enum Kind { NUL, BOOL, NUM, STR, ARR, OBJ } kind = NUL;
+    bool b = false;
+    string text;                     // string value or number literal
+    vector<Json> arr;
+    vector<pair<string,Json>> obj;
+
+    const Json* get(const string &key) const {
+        for(auto &kv: obj) if(kv.first==key) return &kv.second;
+        return nullptr;
+    }
+
+    // Throws runtime_error describing the first syntax error.
+    static Json parse(string_view s){
+        size_t i=0;
+        Json v = parse_value(s, i, 0);
+        skip_ws(s, i);
+        if(i!=s.size()) fail("trailing characters", i);
+        return v;
+    }
+
+private:
+    [[noreturn]] static void fail(const char* what, size_t at){
+        throw runtime_error(string("JSON ") + what + " at offset " + to_string(at));
+    }
+
+    static void skip_ws(string_view s, size_t &i){
+        while(i<s.size() && is_blank(s[i])) i++;
+    }
+
+    static void put_utf8(string &out, uint32_t cp){
+        if(cp<0x80) out.push_back((char)cp);
+        else if(cp<0x800){ out.push_back((char)(0xC0|(cp>>6))); out.push_back((char)(0x80|(cp&0x3F))); }
+        else if(cp<0x10000){
+            out.push_back((char)(0xE0|(cp>>12)));
+            out.push_back((char)(0x80|((cp>>6)&0x3F)));
+            out.push_back((char)(0x80|(cp&0x3F)));
+        } else {
+            out.push_back((char)(0xF0|(cp>>18)));
+            out.push_back((char)(0x80|((cp>>12)&0x3F)));
+            out.push_back((char)(0x80|((cp>>6)&0x3F)));
+            out.push_back((char)(0x80|(cp&0x3F)));
+        }
+    }
+
+    static uint32_t hex4(string_view s, size_t &i){
+        if(i+4>s.size()) fail("bad \\u escape", i);
+        uint32_t v=0;
+        for(int k=0;k<4;++k){
+            char c = s[i++];
+            v <<= 4;
+            if(c>='0' && c<='9') v |= c-'0';
+            else if(c>='a' && c<='f') v |= c-'a'+10;
+            else if(c>='A' && c<='F') v |= c-'A'+10;
+            else fail("bad \\u escape", i-1);
+        }
+        return v;
+    }
+
+    static string parse_string(string_view s, size_t &i){
+        string out;
+        i++;   // opening quote
+        while(true){
+            if(i>=s.size()) fail("unterminated string", i);
+            char c = s[i++];
+            if(c=='"') return out;
+            if(c!='\\'){ out.push_back(c); continue; }
+            if(i>=s.size()) fail("unterminated string", i);
+            char e = s[i++];
+            switch(e){
+            case '"': case '\\': case '/': out.push_back(e); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                uint32_t cp = hex4(s, i);
+                if(cp>=0xD800 && cp<0xDC00 && i+1<s.size() && s[i]=='\\' && s[i+1]=='u'){
+                    i += 2;
+                    uint32_t lo = hex4(s, i);
+                    cp = 0x10000 + ((cp-0xD800)<<10) + (lo-0xDC00);
+                }
+                put_utf8(out, cp);
+                break;
+            }
+            default: fail("bad escape", i-1);
+            }
+        }
+    }
+
+    static Json parse_value(string_view s, size_t &i, int depth){
+        if(depth>64) fail("nesting too deep", i);
+        skip_ws(s, i);
+        if(i>=s.size()) fail("unexpected end", i);
+        Json v;
+        char c = s[i];
+        if(c=='{'){
+            v.kind = OBJ;
+            i++;
+            skip_ws(s, i);
+            if(i<s.size() && s[i]=='}'){ i++; return v; }
+            while(true){
+                skip_ws(s, i);
+                if(i>=s.size() || s[i]!='"') fail("expected key", i);
+                string key = parse_string(s, i);
+                skip_ws(s, i);
+                if(i>=s.size() || s[i]!=':') fail("expected ':'", i);
+                i++;
+                v.obj.emplace_back(move(key), parse_value(s, i, depth+1));
+                skip_ws(s, i);
+                if(i<s.size() && s[i]==','){ i++; continue; }
+                if(i<s.size() && s[i]=='}'){ i++; return v; }
+                fail("expected ',' or '}'", i);
+            }
+        }
+        if(c=='['){
+            v.kind = ARR;
+            i++;
+            skip_ws(s, i);
+            if(i<s.size() && s[i]==']'){ i++; return v; }
+            while(true){
+                v.arr.push_back(parse_value(s, i, depth+1));
+                skip_ws(s, i);
+                if(i<s.size() && s[i]==','){ i++; continue; }
+                if(i<s.size() && s[i]==']'){ i++; return v; }
+                fail("expected ',' or ']'", i);
+            }
+        }
+        if(c=='"'){ v.kind = STR; v.text = parse_string(s, i); return v; }
+        if(s.substr(i,4)=="true"){ v.kind = BOOL; v.b = true; i += 4; return v; }
+        if(s.substr(i,5)=="false"){ v.kind = BOOL; i += 5; return v; }
+        if(s.substr(i,4)=="null"){ i += 4; return v; }
+        if(c=='-' || isdigit((unsigned char)c)){
+            size_t st = i++;
+            while(i<s.size() && (isdigit((unsigned char)s[i]) || s[i]=='.' || s[i]=='e'
+                                 || s[i]=='E' || s[i]=='+' || s[i]=='-')) i++;
+            v.kind = NUM;
+            v.text = string(s.substr(st, i-st));
+            return v;
+        }
+        fail("unexpected character", i);
+    }
+};
+
+// Appends s as a JSON string literal.
+void put_json(string &out, string_view s){
+    out.push_back('"');
+    for(char c: s){
+        switch(c){
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if((unsigned char)c < 0x20){
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else out.push_back(c);
+        }
+    }
+    out.push_back('"');
+}
+
+string json_quote(string_view s){
+    string out;
+    put_json(out, s);
+    return out;
+}
+
+/* ---------- Code Interning ---------- */
+
+/*
+  Process-wide table of product and customer codes. Invoice, dispatch and
+  consignment records hold 32-bit ids, and the string is looked up only
+  for file I/O and display. Id 0 is the empty code. Strings are never
+  moved once added, so str() is lock-free. Codes are interned only for
+  records that are stored; lookups use find(), so a mistyped code never
+  enters the table. Each thread keeps the codes it met last in a small
+  table by hash, checked before the lock: the parallel loaders meet the
+  same codes over and over and mostly never touch mx.
+*/
+struct CodeTable {
+    static constexpr size_t BLOCK_BITS = 16, BLOCK = 1<<BLOCK_BITS;
+    static constexpr size_t RECENT = 1024;
+
+    mutable shared_mutex mx;
+    unique_ptr<atomic<string*>[]> blocks{new atomic<string*>[BLOCK]()};
+    atomic<uint32_t> count{0};
+    unordered_map<string_view,uint32_t> ids;
+
+    CodeTable(){ intern(""); }
+    ~CodeTable(){ for(size_t b=0;b<BLOCK;++b) delete[] blocks[b].load(); }
+
+    const string& str(uint32_t id) const {
+        return blocks[id>>BLOCK_BITS].load(memory_order_acquire)[id&(BLOCK-1)];
+    }
+
+    // Id of code if it has been interned.
+    bool find(string_view code, uint32_t &id) const {
+        size_t h = std::hash<string_view>{}(code);
+        if(recent_hit(code, h, id)) return true;
+        shared_lock<shared_mutex> lk(mx);
+        auto it = ids.find(code);
+        if(it==ids.end()) return false;
+        id = it->second;
+        remember(h, id);
+        return true;
+    }
+
+    uint32_t intern(string_view code){
+        size_t h = std::hash<string_view>{}(code);
+        uint32_t id;
+        if(recent_hit(code, h, id)) return id;
+        unique_lock<shared_mutex> lk(mx);
+        auto it = ids.find(code);
+        if(it!=ids.end()){ remember(h, it->second); return it->second; }
+        id = count.load(memory_order_relaxed);
+        string* block = blocks[id>>BLOCK_BITS].load(memory_order_relaxed);
+        if(!block){
+            block = new string[BLOCK];
+            blocks[id>>BLOCK_BITS].store(block, memory_order_release);
+        }
+        string &slot = block[id&(BLOCK-1)];
+        slot = code;
+        ids.emplace(slot, id);
+        count.store(id+1, memory_order_release);
+        remember(h, id);
+        return id;
+    }
+
+    size_t size() const { return count.load(memory_order_acquire); }
+
+    // Room for n more codes before a bulk insert.
+    void reserve(size_t n){
+        unique_lock<shared_mutex> lk(mx);
+        ids.reserve(ids.size()+n);
+    }
+
+private:
+    struct Recent { const CodeTable* table; size_t hash; uint32_t id; };
+
+    static Recent& recent(size_t h){
+        thread_local array<Recent,RECENT> r{};
+        return r[h & (RECENT-1)];
+    }
+
+    bool recent_hit(string_view code, size_t h, uint32_t &id) const {
+        const Recent &r = recent(h);
+        if(r.table!=this || r.hash!=h || str(r.id)!=code) return false;
+        id = r.id;
+        return true;
+    }
+
+    void remember(size_t h, uint32_t id) const { recent(h) = {this, h, id}; }
+};
+
+CodeTable codes;
+
 /* ---------- Domain Classes ---------- */
 
 struct Product {
@@ -76,22 +510,37 @@ struct Product {
 
     Product(): qty(0) {}
 
-    string to_line() const {
-        string d = description;
-        if(d.find(',')!=string::npos) d = "\"" + d + "\"";
-        return code + "," + name + "," + d + "," + to_string(qty);
+    string to_line() const { return to_line(qty); }
+
+    // The line with quantity q, for callers that read qty atomically.
+    // Text fields are quoted as CSV when they need it.
+    string to_line(long long q) const {
+        string out;
+        put_csv(out, code); out += ',';
+        put_csv(out, name); out += ',';
+        put_csv(out, description); out += ',';
+        out += to_string(q);
+        return out;
     }
 
-    static Product from_line(const string &line){
-        Product p;
-        auto parts = split(line, ',');
-        if(parts.size()>=4){
-            p.code = parts[0];
-            p.name = parts[1];
-            p.description = parts[2];
-            p.qty = stoll(parts[3]);
-        }
-        return p;
+    // The record parsers fill in the record and return what is wrong with
+    // the line, or "" when nothing is.
+    static string from_line(const string &line, Product &p){
+        vector<string_view> parts;
+        split_view(line, ',', parts);
+        return from_fields(parts, p);
+    }
+
+    bool plain() const { return plain_text(code) && plain_text(name) && plain_text(description); }
+
+    static string from_fields(const vector<string_view> &parts, Product &p){
+        if(parts.size()<4) return "expected 4 fields, found " + to_string(parts.size());
+        p.code = unquote(parts[0]);
+        if(p.code.empty()) return "missing code";
+        p.name = unquote(parts[1]);
+        p.description = unquote(parts[2]);
+        if(!parse_qty(parts[3], p.qty)) return "qty is not a whole number";
+        return "";
     }
 };
 
@@ -102,87 +551,234 @@ struct Customer {
     string address;
 
     string to_line() const {
-        string a = address;
-        if(a.find(',')!=string::npos) a = "\"" + a + "\"";
-        return code + "," + name + "," + phone + "," + a;
+        string out;
+        put_csv(out, code); out += ',';
+        put_csv(out, name); out += ',';
+        put_csv(out, phone); out += ',';
+        put_csv(out, address);
+        return out;
     }
 
-    static Customer from_line(const string &line){
-        Customer c;
-        auto parts = split(line, ',');
-        if(parts.size()>=4){
-            c.code = parts[0];
-            c.name = parts[1];
-            c.phone = parts[2];
-            c.address = parts[3];
-        }
-        return c;
+    static string from_line(const string &line, Customer &c){
+        vector<string_view> parts;
+        split_view(line, ',', parts);
+        return from_fields(parts, c);
+    }
+
+    bool plain() const {
+        return plain_text(code) && plain_text(name) && plain_text(phone) && plain_text(address);
+    }
+
+    static string from_fields(const vector<string_view> &parts, Customer &c){
+        if(parts.size()<4) return "expected 4 fields, found " + to_string(parts.size());
+        c.code = unquote(parts[0]);
+        if(c.code.empty()) return "missing code";
+        c.name = unquote(parts[1]);
+        c.phone = unquote(parts[2]);
+        c.address = unquote(parts[3]);
+        return "";
     }
 };
 
-struct InvoiceItem {
-    string product_code;
+// An item as entered at the console or in a batch line, before its
+// record is accepted: the code is interned, and the item copied into
+// item_arena, only once the record is stored.
+struct ItemLine {
+    string product;
     long long qty;
+};
+
+struct InvoiceItem {
+    uint32_t product = 0;   // interned product code
+    long long qty = 0;
+
+    InvoiceItem() {}
+    InvoiceItem(string_view code, long long q): product(codes.intern(code)), qty(q) {}
+
+    const string& product_code() const { return codes.str(product); }
+
+    // l with its code looked up, not interned; false for a code that is
+    // in no record.
+    static bool lookup(const ItemLine &l, InvoiceItem &out){
+        if(!codes.find(l.product, out.product)) return false;
+        out.qty = l.qty;
+        return true;
+    }
 
     string to_line() const {
-        return product_code + "," + to_string(qty);
+        return product_code() + "," + to_string(qty);
+    }
+
+    static string from_line(const string &line, InvoiceItem &it){
+        vector<string_view> p;
+        split_view(line, ',', p);
+        if(p.size()<2) return "expected 2 fields, found " + to_string(p.size());
+        if(!parse_qty(p[1], it.qty)) return "qty is not a whole number";
+        it.product = codes.intern(p[0]);
+        return "";
     }
+};
 
-    static InvoiceItem from_line(const string &line){
-        InvoiceItem it;
-        auto p = split(line, ',');
-        if(p.size()>=2){
-            it.product_code = p[0];
-            it.qty = stoll(p[1]);
+/* ---------- Item Arena ---------- */
+
+/*
+  Invoice and dispatch items are never edited once recorded, so they live
+  in large blocks shared by the whole history instead of one vector per
+  record. Each thread carves slices out of the current block under a lock
+  and hands out items from its slice without locking. Blocks double in
+  size up to BLOCK_MAX, so loading millions of lines takes a handful of
+  allocations and teardown frees a handful of blocks.
+
+  Nothing is freed before exit, so only records that are kept allocate
+  here: console and batch input stays in ItemLine vectors until its
+  record is accepted, a line that fails to parse hands its items straight
+  back with shrink(), and journal records already on disk are skipped
+  before their items are read. The arena holds the items of the history
+  in memory plus, per thread that has allocated, the unused rest of one
+  slice, and the unclaimed end of the newest block.
+*/
+struct ItemArena {
+    static constexpr size_t BLOCK_MIN = 1<<12;
+    static constexpr size_t BLOCK_MAX = 1<<22;
+    static constexpr size_t SLICE = 1<<10;
+
+    struct Slice { InvoiceItem *cur = nullptr; size_t left = 0; };
+
+    mutex m;
+    vector<unique_ptr<InvoiceItem[]>> blocks;
+    Slice block;            // unclaimed part of the newest block
+    size_t next_block = BLOCK_MIN;
+
+    static Slice& local(){ thread_local Slice s; return s; }
+
+    // Room for n items on this thread, assuming the previous slice is full.
+    void refill(Slice &s, size_t n){
+        size_t want = max(n, SLICE);
+        lock_guard<mutex> lk(m);
+        if(block.left < want){
+            size_t size = max(want, next_block);
+            blocks.emplace_back(new InvoiceItem[size]);
+            block.cur = blocks.back().get();
+            block.left = size;
+            next_block = min(next_block*2, BLOCK_MAX);
         }
-        return it;
+        s.cur = block.cur; s.left = want;
+        block.cur += want; block.left -= want;
+    }
+
+    InvoiceItem* alloc(size_t n){
+        Slice &s = local();
+        if(s.left < n) refill(s, n);
+        InvoiceItem *p = s.cur;
+        s.cur += n; s.left -= n;
+        return p;
+    }
+
+    // Return the unused tail of this thread's latest alloc(n) at p.
+    void shrink(InvoiceItem *p, size_t n, size_t used){
+        Slice &s = local();
+        if(p + n == s.cur){ s.cur = p + used; s.left += n - used; }
+    }
+};
+ItemArena item_arena;
+
+// A record's items: a read-only run inside item_arena.
+struct ItemSpan {
+    const InvoiceItem *ptr = nullptr;
+    uint32_t n = 0;
+
+    const InvoiceItem* begin() const { return ptr; }
+    const InvoiceItem* end() const { return ptr + n; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    const InvoiceItem& operator[](size_t i) const { return ptr[i]; }
+
+    static ItemSpan of(const vector<InvoiceItem> &items){
+        ItemSpan s;
+        if(items.empty()) return s;
+        InvoiceItem *p = item_arena.alloc(items.size());
+        copy(items.begin(), items.end(), p);
+        s.ptr = p; s.n = (uint32_t)items.size();
+        return s;
+    }
+
+    // The items of a record being stored, their codes interned.
+    static ItemSpan of(const vector<ItemLine> &lines){
+        ItemSpan s;
+        if(lines.empty()) return s;
+        InvoiceItem *p = item_arena.alloc(lines.size());
+        for(size_t i=0;i<lines.size();++i) p[i] = InvoiceItem(lines[i].product, lines[i].qty);
+        s.ptr = p; s.n = (uint32_t)lines.size();
+        return s;
     }
 };
 
+// "code:qty;code:qty" as stored in invoice and dispatch lines.
+string items_field(const ItemSpan &items){
+    string out;
+    for(size_t i=0;i<items.size();++i){
+        if(i) out.push_back(';');
+        out += items[i].product_code();
+        out.push_back(':');
+        out += to_string(items[i].qty);
+    }
+    return out;
+}
+
 struct Invoice {
     string number;
     string type;
     string date;
-    string customer_code;
-    vector<InvoiceItem> items;
+    uint32_t customer = 0;  // interned customer code, 0 when none
+    ItemSpan items;
+
+    const string& customer_code() const { return codes.str(customer); }
 
     string to_block() const {
-        vector<string> parts;
-        for(auto &it: items)
-            parts.push_back(it.product_code + ":" + to_string(it.qty));
-        string items_join = join(parts, ';');
-        return number + "," + type + "," + date + "," + customer_code + "," + items_join;
+        return number + "," + type + "," + date + "," + customer_code() + "," + items_field(items);
     }
 
-    static Invoice from_block(const string &line){
-        Invoice inv;
-        auto p = split(line, ',');
-        if(p.size()>=5){
-            inv.number = p[0];
-            inv.type = p[1];
-            inv.date = p[2];
-            inv.customer_code = p[3];
-            string items_join = p[4];
-
-            vector<string> raw;
-            string cur;
-            for(char c: items_join){
-                if(c==';'){ raw.push_back(cur); cur.clear(); }
-                else cur.push_back(c);
-            }
-            if(!cur.empty()) raw.push_back(cur);
-
-            for(auto &s: raw){
-                size_t pos = s.find(':');
-                if(pos!=string::npos){
-                    InvoiceItem it;
-                    it.product_code = s.substr(0,pos);
-                    it.qty = stoll(s.substr(pos+1));
-                    inv.items.push_back(it);
+    static string from_block(const string &line, Invoice &inv){
+        vector<string_view> p;
+        split_view(line, ',', p);
+        return from_fields(p, inv);
+    }
+
+    static string from_fields(const vector<string_view> &p, Invoice &inv){
+        if(p.size()<5) return "expected 5 fields, found " + to_string(p.size());
+        inv.number = p[0];
+        inv.type = p[1];
+        inv.date = p[2];
+        inv.customer = codes.intern(p[3]);
+        return parse_items(p[4], inv.items);
+    }
+
+    // "code:qty;code:qty" -> items, or what is wrong with the first bad
+    // piece. Pieces without ':' are ignored.
+    static string parse_items(string_view items_join, ItemSpan &out){
+        out = ItemSpan();
+        if(items_join.empty()) return "";
+        size_t cap = count(items_join.begin(), items_join.end(), ';')+1, n=0;
+        InvoiceItem *p = item_arena.alloc(cap);
+        size_t start=0;
+        while(start<items_join.size()){
+            size_t end = items_join.find(';', start);
+            if(end==string_view::npos) end = items_join.size();
+            string_view s = items_join.substr(start, end-start);
+            size_t pos = s.find(':');
+            long long qty;
+            if(pos!=string_view::npos){
+                if(!parse_qty(s.substr(pos+1), qty)){
+                    item_arena.shrink(p, cap, 0);
+                    return "qty of " + string(s.substr(0,pos)) + " is not a whole number";
                 }
+                p[n++] = InvoiceItem(s.substr(0,pos), qty);
             }
+            start = end+1;
         }
-        return inv;
+        item_arena.shrink(p, cap, n);
+        if(n){ out.ptr = p; out.n = (uint32_t)n; }
+        return "";
     }
 };
 
@@ -190,216 +786,2883 @@ struct Dispatch {
     string number;
     string invoice_number;
     string date;
-    vector<InvoiceItem> items;
+    ItemSpan items;
 
     string to_block() const {
-        vector<string> parts;
-        for(auto &it: items)
-            parts.push_back(it.product_code + ":" + to_string(it.qty));
-        return number + "," + invoice_number + "," + date + "," + join(parts, ';');
+        return number + "," + invoice_number + "," + date + "," + items_field(items);
     }
 
-    static Dispatch from_block(const string &line){
-        Dispatch d;
-        auto p = split(line, ',');
-        if(p.size()>=4){
-            d.number = p[0];
-            d.invoice_number = p[1];
-            d.date = p[2];
-
-            string items_join = p[3];
-            vector<string> raw;
-            string cur;
-            for(char c: items_join){
-                if(c==';'){ raw.push_back(cur); cur.clear(); }
-                else cur.push_back(c);
-            }
-            if(!cur.empty()) raw.push_back(cur);
-
-            for(auto &s: raw){
-                size_t pos = s.find(':');
-                if(pos!=string::npos){
-                    InvoiceItem it;
-                    it.product_code = s.substr(0,pos);
-                    it.qty = stoll(s.substr(pos+1));
-                    d.items.push_back(it);
-                }
-            }
-        }
-        return d;
+    static string from_block(const string &line, Dispatch &d){
+        vector<string_view> p;
+        split_view(line, ',', p);
+        return from_fields(p, d);
+    }
+
+    static string from_fields(const vector<string_view> &p, Dispatch &d){
+        if(p.size()<4) return "expected 4 fields, found " + to_string(p.size());
+        d.number = p[0];
+        d.invoice_number = p[1];
+        d.date = p[2];
+        return Invoice::parse_items(p[3], d.items);
     }
 };
 
-/* ---------- FileManager ---------- */
+/* ---------- Mapped Files ---------- */
 
-struct FileManager {
-    string products_file = "products.txt";
-    string customers_file = "customers.txt";
-    string invoices_file = "invoices.txt";
-    string dispatches_file = "dispatches.txt";
-    string admin_file = "admin.txt";
-    string consignment_file = "consignment.txt";
+// Read-only view of a whole file: mmap'ed where available, otherwise read
+// into a buffer. A missing file is an empty view.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    string buffer;
+#if !defined(_WIN32)
+    void* map = nullptr;
+#endif
 
-    vector<Product> load_products(){
-        vector<Product> out;
-        ifstream f(products_file);
-        string line;
-        while(getline(f,line)){
-            line = trim(line);
-            if(!line.empty())
-                out.push_back(Product::from_line(line));
+    explicit MappedFile(const string &path){
+#if !defined(_WIN32)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd<0) return;
+        struct stat st;
+        if(fstat(fd, &st)==0 && st.st_size>0){
+            void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(m!=MAP_FAILED){
+                map = m;
+                data = (const char*)m;
+                size = st.st_size;
+                madvise(m, size, MADV_SEQUENTIAL);
+            }
         }
-        return out;
+        ::close(fd);
+        if(map) return;
+#endif
+        ifstream f(path, ios::binary);
+        if(!f) return;
+        buffer.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
     }
 
-    void save_products(const vector<Product>& arr){
-        ofstream f(products_file, ios::trunc);
-        for(auto &p: arr)
-            f << p.to_line() << "\n";
+    ~MappedFile(){
+#if !defined(_WIN32)
+        if(map) munmap(map, size);
+#endif
     }
 
-    vector<Customer> load_customers(){
-        vector<Customer> out;
-        ifstream f(customers_file);
-        string line;
-        while(getline(f,line)){
-            line = trim(line);
-            if(!line.empty())
-                out.push_back(Customer::from_line(line));
-        }
-        return out;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    string_view view() const { return string_view(data ? data : "", size); }
+};
+
+// Calls fn(fields) for every non-blank line, split the same way as split().
+template<class F>
+void for_each_record(string_view text, F fn){
+    vector<string_view> fields;
+    size_t pos = 0;
+    while(pos<text.size()){
+        size_t end = find_newline(text, pos);
+        string_view line = trim_view(text.substr(pos, end-pos));
+        pos = end+1;
+        if(line.empty()) continue;
+        split_view(line, ',', fields);
+        fn(fields);
     }
+}
 
-    void save_customers(const vector<Customer>& arr){
-        ofstream f(customers_file, ios::trunc);
-        for(auto &c: arr)
-            f << c.to_line() << "\n";
+/* ---------- Atomic Files ---------- */
+
+/*
+  Files are replaced, never rewritten in place: the new contents go to
+  "<path>.tmp", which is synced to disk and renamed over path, and then
+  the directory is synced so the rename itself is durable. A crash at any
+  point leaves either the old file or the new one.
+*/
+
+inline int sync_fd(int fd){
+#if defined(_WIN32)
+    return _commit(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+void sync_parent_dir(const string &path){
+#if !defined(_WIN32)
+    string dir = filesystem::path(path).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if(fd<0) return;
+    fsync(fd);
+    ::close(fd);
+#else
+    (void)path;
+#endif
+}
+
+void write_atomic(const string &path, string_view data){
+    string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(!f) throw runtime_error("cannot write " + tmp);
+    bool ok = fwrite(data.data(), 1, data.size(), f)==data.size() && fflush(f)==0 && sync_fd(fileno(f))==0;
+    ok = fclose(f)==0 && ok;
+    error_code ec;
+    if(ok) filesystem::rename(tmp, path, ec);
+    if(!ok || ec){
+        filesystem::remove(tmp, ec);
+        throw runtime_error("cannot write " + path);
     }
+    sync_parent_dir(path);
+}
 
-    vector<Invoice> load_invoices(){
-        vector<Invoice> out;
-        ifstream f(invoices_file);
-        string line;
-        while(getline(f,line)){
-            line = trim(line);
-            if(!line.empty())
-                out.push_back(Invoice::from_block(line));
-        }
-        return out;
+/* ---------- Metrics ---------- */
+
+/*
+  Latency histograms for the hot paths. Every thread records into its own
+  log-linear histograms (HDR style: 8 sub-buckets per power of two, so a
+  value is kept to within 12.5%), so recording takes no lock and touches
+  no shared cache line. dump() merges the live threads' histograms with
+  those of threads that have exited and writes them as a Prometheus
+  summary. Timing is off unless --metrics is given; a disabled timer
+  costs one flag test.
+
+  Reading the clock around a lookup costs more than the lookup, mostly
+  by stalling the memory accesses of neighbouring calls, so the
+  in-memory find_product and find_customer time one call in 2^shift,
+  counted per metric and thread. Their count is exact; quantiles and
+  max come from the sample and the sum is the sample mean times the
+  count. find_invoice and find_dispatch may read a month from disk, so
+  every call is timed.
+*/
+
+enum MetricId : uint8_t {
+    M_LOAD_PRODUCTS, M_LOAD_CUSTOMERS, M_LOAD_HISTORY, M_LOAD_MONTH, M_LOAD_CONSIGNMENT,
+    M_SAVE_PRODUCTS, M_SAVE_CUSTOMERS, M_SAVE_MONTH, M_SAVE_CONSIGNMENT, M_JOURNAL_SYNC,
+    M_FIND_PRODUCT, M_FIND_CUSTOMER, M_FIND_INVOICE, M_FIND_DISPATCH,
+    M_NEXT_NUMBER, M_DISPATCHED_FOR_INVOICE, M_CREATE_INVOICE, M_CREATE_DISPATCH,
+    M_REQUEST, M_COUNT
+};
+
+const char* const METRIC_NAMES[M_COUNT] = {
+    "load_products", "load_customers", "load_history", "load_month", "load_consignment",
+    "save_products", "save_customers", "save_month", "save_consignment", "journal_sync",
+    "find_product", "find_customer", "find_invoice", "find_dispatch",
+    "next_number", "dispatched_for_invoice", "create_invoice", "create_dispatch",
+    "request"
+};
+
+const uint8_t METRIC_SAMPLE_SHIFT[M_COUNT] = {
+    0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0,
+    5, 5, 0, 0,
+    0, 0, 0, 0,
+    0
+};
+
+// Nanosecond histogram of the timed calls, and the count of all calls.
+// Only its thread writes it; counters are relaxed atomics so dump() may
+// read while it records.
+struct Histogram {
+    static constexpr int SUB_BITS = 3, SUB = 1<<SUB_BITS;
+    static constexpr int BUCKETS = 2*SUB + (63-SUB_BITS)*SUB;
+
+    array<uint64_t,BUCKETS> counts{};
+    uint64_t total = 0, sum = 0, max = 0, calls = 0;
+
+    // Values below 2*SUB get a bucket each; above, bucket width doubles
+    // with every power of two.
+    static int bucket(uint64_t v){
+        if(v < 2*SUB) return (int)v;
+        int e = 63 - __builtin_clzll(v);
+        return 2*SUB + (e-SUB_BITS-1)*SUB + (int)((v >> (e-SUB_BITS)) & (SUB-1));
     }
 
-    void save_invoices(const vector<Invoice>& arr){
-        ofstream f(invoices_file, ios::trunc);
-        for(auto &i: arr)
-            f << i.to_block() << "\n";
+    // Largest value that falls in bucket b.
+    static uint64_t upper(int b){
+        if(b < 2*SUB) return b;
+        int e = (b-2*SUB)/SUB + SUB_BITS+1, sub = (b-2*SUB)%SUB;
+        return ((uint64_t)(SUB+sub+1) << (e-SUB_BITS)) - 1;
     }
 
-    vector<Dispatch> load_dispatches(){
-        vector<Dispatch> out;
-        ifstream f(dispatches_file);
-        string line;
-        while(getline(f,line)){
-            line = trim(line);
-            if(!line.empty())
-                out.push_back(Dispatch::from_block(line));
-        }
-        return out;
+    static uint64_t get(const uint64_t &c){ return shared_ref(c).load(memory_order_relaxed); }
+    static void put(uint64_t &c, uint64_t v){ shared_ref(c).store(v, memory_order_relaxed); }
+
+    // Counts a call; true when it is one of the 2^shift to time.
+    bool tick(int shift){
+        uint64_t n = get(calls);
+        put(calls, n+1);
+        return (n & ((1ULL << shift) - 1)) == 0;
     }
 
-    void save_dispatches(const vector<Dispatch>& arr){
-        ofstream f(dispatches_file, ios::trunc);
-        for(auto &d: arr)
-            f << d.to_block() << "\n";
+    void record(uint64_t ns){
+        uint64_t &c = counts[bucket(ns)];
+        put(c, get(c)+1);
+        put(total, get(total)+1);
+        put(sum, get(sum)+ns);
+        if(ns > get(max)) put(max, ns);
     }
 
-    pair<string,string> load_admin(){
-        ifstream f(admin_file);
-        string u,p;
-        if(!(f>>u>>p)){
-            u="admin"; p="admin";
-            ofstream out(admin_file);
-            out << u << " " << p << "\n";
+    void add_to(Histogram &out) const {
+        for(int b=0;b<BUCKETS;++b) out.counts[b] += get(counts[b]);
+        out.total += get(total);
+        out.sum += get(sum);
+        out.max = std::max(out.max, get(max));
+        out.calls += get(calls);
+    }
+
+    // Upper bound of the bucket holding the q-th value, capped at max.
+    uint64_t quantile(double q) const {
+        uint64_t rank = (uint64_t)ceil(q * total), seen = 0;
+        for(int b=0;b<BUCKETS;++b){
+            seen += counts[b];
+            if(seen >= std::max(rank, (uint64_t)1)) return std::min(upper(b), max);
         }
-        return {u,p};
+        return max;
     }
+};
 
-    void save_admin(const string &u, const string &p){
-        ofstream f(admin_file, ios::trunc);
-        f << u << " " << p << "\n";
+struct Metrics {
+    using Set = array<Histogram,M_COUNT>;
+
+    atomic<bool> enabled{false};
+    string path;                 // Prometheus text file written by dump()
+    mutex mx;
+    set<Set*> live;
+    Set retired;                 // histograms of threads that have exited
+
+    struct Local {
+        Metrics &owner;
+        unique_ptr<Set> hs;
+        explicit Local(Metrics &m): owner(m) {}
+        ~Local(){
+            if(!hs) return;
+            lock_guard<mutex> lk(owner.mx);
+            for(int i=0;i<M_COUNT;++i) (*hs)[i].add_to(owner.retired[i]);
+            owner.live.erase(hs.get());
+        }
+    };
+
+    // The calling thread's histograms, allocated on first use and folded
+    // into retired when the thread ends.
+    Set& local(){
+        thread_local Local mine(*this);
+        if(!mine.hs){
+            mine.hs = make_unique<Set>();
+            lock_guard<mutex> lk(mx);
+            live.insert(mine.hs.get());
+        }
+        return *mine.hs;
     }
 
-    vector<tuple<string,string,long long>> load_consignment(){
-        vector<tuple<string,string,long long>> out;
-        ifstream f(consignment_file);
-        string line;
-        while(getline(f,line)){
-            line = trim(line);
-            if(line.empty()) continue;
-            auto parts = split(line, ',');
-            if(parts.size()>=3)
-                out.emplace_back(parts[0], parts[1], stoll(parts[2]));
+    // Counts a call of id; true when it is to be timed.
+    bool tick(MetricId id){ return local()[id].tick(METRIC_SAMPLE_SHIFT[id]); }
+
+    void record(MetricId id, uint64_t ns){ local()[id].record(ns); }
+
+    Set merged(){
+        lock_guard<mutex> lk(mx);
+        Set out = retired;
+        for(Set* hs: live)
+            for(int i=0;i<M_COUNT;++i) (*hs)[i].add_to(out[i]);
+        return out;
+    }
+
+    string prometheus(){
+        Set all = merged();
+        string out = "# HELP wms_latency_seconds Latency of warehouse operations.\n"
+                     "# TYPE wms_latency_seconds summary\n";
+        char line[160];
+        for(int i=0;i<M_COUNT;++i){
+            const Histogram &h = all[i];
+            if(!h.total) continue;
+            for(double q: {0.5, 0.9, 0.99, 0.999}){
+                snprintf(line, sizeof(line), "wms_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9g\n",
+                         METRIC_NAMES[i], q, h.quantile(q)/1e9);
+                out += line;
+            }
+            // The sample mean scaled up to every call; exact when unsampled.
+            double sum = (double)h.sum * h.calls / h.total;
+            snprintf(line, sizeof(line), "wms_latency_seconds_sum{op=\"%s\"} %.9g\n", METRIC_NAMES[i], sum/1e9);
+            out += line;
+            snprintf(line, sizeof(line), "wms_latency_seconds_count{op=\"%s\"} %llu\n", METRIC_NAMES[i], (unsigned long long)h.calls);
+            out += line;
+        }
+        out += "# HELP wms_latency_max_seconds Slowest call of each operation.\n"
+               "# TYPE wms_latency_max_seconds gauge\n";
+        for(int i=0;i<M_COUNT;++i){
+            if(!all[i].total) continue;
+            snprintf(line, sizeof(line), "wms_latency_max_seconds{op=\"%s\"} %.9g\n", METRIC_NAMES[i], all[i].max/1e9);
+            out += line;
         }
         return out;
     }
 
-    void save_consignment(const vector<tuple<string,string,long long>>& arr){
-        ofstream f(consignment_file, ios::trunc);
-        for(auto &t: arr)
-            f << get<0>(t) << "," << get<1>(t) << "," << get<2>(t) << "\n";
+    // Writes the Prometheus file; "" on success, else the error.
+    string dump(){
+        if(path.empty()) return "Metrics are off (start with --metrics FILE).";
+        try{ write_atomic(path, prometheus()); }
+        catch(const exception &e){ return e.what(); }
+        return "";
     }
 };
 
-/* ---------- Application ---------- */
+Metrics metrics;
 
-struct App {
-    FileManager fm;
-    vector<Product> products;
+// Records the lifetime of the enclosing scope under id.
+struct LatencyTimer {
+    MetricId id;
+    bool on;
+    chrono::steady_clock::time_point t0;
+
+    explicit LatencyTimer(MetricId m): id(m), on(metrics.enabled.load(memory_order_relaxed) && metrics.tick(m)) {
+        if(on) t0 = chrono::steady_clock::now();
+    }
+    ~LatencyTimer(){
+        if(on) metrics.record(id, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-t0).count());
+    }
+};
+
+/* ---------- Journal ---------- */
+
+/*
+  Append-only mutation log. Every record is one line "<tag>|<payload>",
+  where payload is the normal text-file line of the record:
+    P product upsert     X product delete (payload = code)
+    C customer upsert    Y customer delete (payload = code)
+    I invoice append     D dispatch append
+    K consignment set (customer,product,total qty)
+  Records are written immediately and made durable by sync(), so one user
+  action costs at most one flush no matter how many records it produced.
+
+  sync() is a group commit. The first caller with records to flush becomes
+  the leader: it waits up to `window` for other sessions to append, then
+  fsyncs once for everything written so far, without holding the lock, so
+  appends carry on meanwhile. Callers arriving during a flush wait for it
+  and return at once if it covered their records; otherwise one of them
+  leads the next flush.
+
+  A failed open, write, flush or fsync is kept in `error`, and every
+  sync() that waits on a record appended since the last good flush
+  throws it, so no caller reports a change as saved that may not be on
+  disk; callers with nothing new to flush are unaffected. reset(), after
+  the snapshots hold everything, starts a new file and clears it.
+*/
+struct Journal {
+    string path;
+    FILE* f = nullptr;
+    mutex mx;
+    condition_variable flushed;
+    uint64_t written = 0;         // records appended so far
+    uint64_t durable = 0;         // of those, known to be on disk
+    bool flushing = false;
+    string error;                 // first failure since the last reset()
+    uint64_t failed_from = 0;     // records after this one may be lost
+    chrono::microseconds window{0};
+    atomic<size_t> records{0};    // records currently in the file
+    atomic<size_t> flushes{0};
+
+    ~Journal(){ close(); }
+
+    // Reads all complete records. A torn last line (crash mid-append) is
+    // dropped and cut off the file so later appends start on a clean line.
+    vector<pair<char,string>> read_all(){
+        vector<pair<char,string>> out;
+        ifstream in(path, ios::binary);
+        if(!in) return out;
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        in.close();
+
+        size_t pos = 0;
+        while(true){
+            size_t nl = data.find('\n', pos);
+            if(nl==string::npos) break;
+            string line = data.substr(pos, nl-pos);
+            pos = nl+1;
+            if(!line.empty() && line.back()=='\r') line.pop_back();
+            if(line.size()>=2 && line[1]=='|')
+                out.emplace_back(line[0], line.substr(2));
+        }
+        if(pos<data.size()){
+            error_code ec;
+            filesystem::resize_file(path, pos, ec);
+        }
+        records = out.size();
+        return out;
+    }
+
+    void open(){
+        close();
+        lock_guard<mutex> lk(mx);
+        f = fopen(path.c_str(), "ab");
+    }
+
+    // A failure is not reported again here: every record is followed by
+    // its caller's own sync(), which has thrown it.
+    void close(){
+        try{ sync(); }
+        catch(const exception&){}
+        unique_lock<mutex> lk(mx);
+        flushed.wait(lk, [&]{ return !flushing; });
+        if(f){ fclose(f); f = nullptr; }
+    }
+
+    void append(char tag, const string &payload){
+        append_with(tag, [&]{ return payload; });
+    }
+
+    // Builds the payload under the journal lock. Records of a value that
+    // sessions update concurrently are then written in the order they were
+    // read, so the last one holds the latest value.
+    template<class F>
+    void append_with(char tag, F payload){
+        lock_guard<mutex> lk(mx);
+        written++;
+        if(!f) f = fopen(path.c_str(), "ab");
+        if(!f){ fail("cannot open " + path); return; }
+        string p = payload();
+        bool ok = fputc(tag, f)!=EOF && fputc('|', f)!=EOF
+               && fwrite(p.data(), 1, p.size(), f)==p.size() && fputc('\n', f)!=EOF;
+        if(!ok) fail("cannot write " + path);
+        records++;
+    }
+
+    // Returns once every record appended before the call is on disk, or
+    // throws runtime_error if one of them may not be.
+    void sync(){
+        LatencyTimer t(M_JOURNAL_SYNC);
+        unique_lock<mutex> lk(mx);
+        uint64_t want = written;
+        while(true){
+            if(!error.empty() && want > failed_from) throw runtime_error(error);
+            if(durable >= want) return;
+            if(flushing){ flushed.wait(lk); continue; }
+            flushing = true;
+            if(window.count()) flushed.wait_for(lk, window);
+            uint64_t upto = written;
+            int fd = -1;
+            bool ok = f && fflush(f)==0;
+            if(ok) fd = fileno(f);
+            lk.unlock();
+            if(fd>=0) ok = sync_fd(fd)==0;
+            lk.lock();
+            if(ok) durable = max(durable, upto);
+            else fail("cannot write " + path);
+            flushing = false;
+            flushes++;
+            flushed.notify_all();
+        }
+    }
+
+    // Called once the snapshot files hold everything the journal described.
+    void reset(){
+        unique_lock<mutex> lk(mx);
+        flushed.wait(lk, [&]{ return !flushing; });
+        if(f){ fclose(f); f = nullptr; }
+        f = fopen(path.c_str(), "wb");
+        durable = written;
+        records = 0;
+        error.clear();
+    }
+
+private:
+    // Called with mx held.
+    void fail(const string &why){
+        if(!error.empty()) return;
+        error = why;
+        failed_from = durable;
+    }
+};
+
+/* ---------- Binary Snapshots ---------- */
+
+/*
+  Optional binary form of the snapshot files (products.bin, ...):
+    "WMSB" | version u8 | kind u8 | payload | CRC-32 of everything before it
+  Integers are LEB128 varints (quantities zigzag-encoded), strings are
+  length-prefixed, and invoices/dispatches/consignment start with a string
+  table so each product or customer code is stored once per file.
+*/
+
+const uint8_t BIN_VERSION = 1;
+enum BinKind : uint8_t { BIN_PRODUCTS=1, BIN_CUSTOMERS, BIN_INVOICES, BIN_DISPATCHES, BIN_CONSIGNMENT };
+
+uint32_t crc32(const void* data, size_t n){
+    static const auto table = []{
+        array<uint32_t,256> t{};
+        for(uint32_t i=0;i<256;++i){
+            uint32_t c=i;
+            for(int k=0;k<8;++k) c = (c&1) ? 0xEDB88320u ^ (c>>1) : c>>1;
+            t[i]=c;
+        }
+        return t;
+    }();
+    uint32_t c = 0xFFFFFFFFu;
+    auto p = (const unsigned char*)data;
+    for(size_t i=0;i<n;++i) c = table[(c ^ p[i]) & 0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+struct BinWriter {
+    string buf;
+
+    BinWriter(BinKind kind){
+        buf = "WMSB";
+        buf.push_back((char)BIN_VERSION);
+        buf.push_back((char)kind);
+    }
+
+    void varint(uint64_t v){
+        while(v>=0x80){ buf.push_back((char)(v|0x80)); v>>=7; }
+        buf.push_back((char)v);
+    }
+
+    void svarint(long long v){ varint(((uint64_t)v<<1) ^ (uint64_t)(v>>63)); }
+
+    void str(const string &s){
+        varint(s.size());
+        buf += s;
+    }
+
+    // Appends the checksum and returns the finished image.
+    string& finish(){
+        uint32_t c = crc32(buf.data(), buf.size());
+        for(int i=0;i<4;++i) buf.push_back((char)(c>>(8*i)));
+        return buf;
+    }
+};
+
+struct BinReader {
+    const unsigned char* p;
+    const unsigned char* end;
+
+    // Validates header and checksum; throws runtime_error on a bad image.
+    BinReader(string_view img, BinKind kind){
+        if(img.size()<10 || img.substr(0,4)!="WMSB")
+            throw runtime_error("not a binary snapshot");
+        if((uint8_t)img[4]!=BIN_VERSION) throw runtime_error("unsupported snapshot version");
+        if((uint8_t)img[5]!=kind) throw runtime_error("wrong snapshot kind");
+        size_t body = img.size()-4;
+        uint32_t stored=0;
+        for(int i=0;i<4;++i) stored |= (uint32_t)(uint8_t)img[body+i] << (8*i);
+        if(crc32(img.data(), body)!=stored) throw runtime_error("snapshot checksum mismatch");
+        p = (const unsigned char*)img.data()+6;
+        end = (const unsigned char*)img.data()+body;
+    }
+
+    uint64_t varint(){
+        uint64_t v=0;
+        for(int shift=0; shift<64; shift+=7){
+            if(p>=end) throw runtime_error("truncated snapshot");
+            uint8_t b = *p++;
+            v |= (uint64_t)(b&0x7F) << shift;
+            if(!(b&0x80)) return v;
+        }
+        throw runtime_error("bad varint in snapshot");
+    }
+
+    long long svarint(){
+        uint64_t v = varint();
+        return (long long)((v>>1) ^ (0-(v&1)));
+    }
+
+    string_view str(){
+        uint64_t n = varint();
+        if(n>(uint64_t)(end-p)) throw runtime_error("truncated snapshot");
+        string_view s((const char*)p, n);
+        p += n;
+        return s;
+    }
+
+    // Reads a count and makes sure at least that many bytes remain, so a
+    // corrupt count cannot trigger a huge reserve().
+    size_t count(){
+        uint64_t n = varint();
+        if(n>(uint64_t)(end-p)) throw runtime_error("bad count in snapshot");
+        return n;
+    }
+};
+
+// Assigns small indexes to repeated strings while encoding.
+struct StringTable {
+    unordered_map<string,uint32_t> ids;
+    vector<const string*> order;
+
+    void add(const string &s){
+        auto r = ids.emplace(s, (uint32_t)order.size());
+        if(r.second) order.push_back(&r.first->first);
+    }
+    uint32_t id(const string &s) const { return ids.at(s); }
+
+    void write(BinWriter &w) const {
+        w.varint(order.size());
+        for(auto s: order) w.str(*s);
+    }
+
+    static vector<string> read(BinReader &r){
+        vector<string> t(r.count());
+        for(auto &s: t) s = r.str();
+        return t;
+    }
+};
+
+inline const string& table_at(const vector<string> &t, uint64_t i){
+    if(i>=t.size()) throw runtime_error("bad string index in snapshot");
+    return t[i];
+}
+
+string encode_snapshot(const vector<Product> &arr){
+    BinWriter w(BIN_PRODUCTS);
+    w.varint(arr.size());
+    for(auto &p: arr){ w.str(p.code); w.str(p.name); w.str(p.description); w.svarint(p.qty); }
+    return move(w.finish());
+}
+
+string encode_snapshot(const vector<Customer> &arr){
+    BinWriter w(BIN_CUSTOMERS);
+    w.varint(arr.size());
+    for(auto &c: arr){ w.str(c.code); w.str(c.name); w.str(c.phone); w.str(c.address); }
+    return move(w.finish());
+}
+
+void encode_items(BinWriter &w, const StringTable &t, const ItemSpan &items){
+    w.varint(items.size());
+    for(auto &it: items){ w.varint(t.id(it.product_code())); w.svarint(it.qty); }
+}
+
+// String table entries interned once per file.
+vector<uint32_t> intern_table(const vector<string> &t){
+    vector<uint32_t> ids(t.size());
+    for(size_t i=0;i<t.size();++i) ids[i] = codes.intern(t[i]);
+    return ids;
+}
+
+inline uint32_t id_at(const vector<uint32_t> &t, uint64_t i){
+    if(i>=t.size()) throw runtime_error("bad string index in snapshot");
+    return t[i];
+}
+
+void decode_items(BinReader &r, const vector<uint32_t> &t, ItemSpan &items){
+    items = ItemSpan();
+    size_t n = r.count();
+    if(!n) return;
+    InvoiceItem *p = item_arena.alloc(n);
+    try {
+        for(size_t i=0;i<n;++i){ p[i].product = id_at(t, r.varint()); p[i].qty = r.svarint(); }
+    } catch(...){
+        item_arena.shrink(p, n, 0);
+        throw;
+    }
+    items.ptr = p; items.n = (uint32_t)n;
+}
+
+string encode_snapshot(const vector<Invoice> &arr){
+    StringTable t;
+    for(auto &i: arr){
+        t.add(i.customer_code());
+        for(auto &it: i.items) t.add(it.product_code());
+    }
+    BinWriter w(BIN_INVOICES);
+    t.write(w);
+    w.varint(arr.size());
+    for(auto &i: arr){
+        w.str(i.number); w.str(i.type); w.str(i.date);
+        w.varint(t.id(i.customer_code()));
+        encode_items(w, t, i.items);
+    }
+    return move(w.finish());
+}
+
+string encode_snapshot(const vector<Dispatch> &arr){
+    StringTable t;
+    for(auto &d: arr)
+        for(auto &it: d.items) t.add(it.product_code());
+    BinWriter w(BIN_DISPATCHES);
+    t.write(w);
+    w.varint(arr.size());
+    for(auto &d: arr){
+        w.str(d.number); w.str(d.invoice_number); w.str(d.date);
+        encode_items(w, t, d.items);
+    }
+    return move(w.finish());
+}
+
+string encode_snapshot(const vector<tuple<string,string,long long>> &arr){
+    StringTable t;
+    for(auto &e: arr){ t.add(get<0>(e)); t.add(get<1>(e)); }
+    BinWriter w(BIN_CONSIGNMENT);
+    t.write(w);
+    w.varint(arr.size());
+    for(auto &e: arr){ w.varint(t.id(get<0>(e))); w.varint(t.id(get<1>(e))); w.svarint(get<2>(e)); }
+    return move(w.finish());
+}
+
+void decode_snapshot(string_view img, vector<Product> &out){
+    BinReader r(img, BIN_PRODUCTS);
+    out.resize(r.count());
+    for(auto &p: out){
+        p.code = r.str(); p.name = r.str(); p.description = r.str(); p.qty = r.svarint();
+        if(p.code.empty()) throw runtime_error("product without a code");
+    }
+}
+
+void decode_snapshot(string_view img, vector<Customer> &out){
+    BinReader r(img, BIN_CUSTOMERS);
+    out.resize(r.count());
+    for(auto &c: out){
+        c.code = r.str(); c.name = r.str(); c.phone = r.str(); c.address = r.str();
+        if(c.code.empty()) throw runtime_error("customer without a code");
+    }
+}
+
+void decode_snapshot(string_view img, vector<Invoice> &out){
+    BinReader r(img, BIN_INVOICES);
+    auto t = intern_table(StringTable::read(r));
+    out.resize(r.count());
+    for(auto &i: out){
+        i.number = r.str(); i.type = r.str(); i.date = r.str();
+        i.customer = id_at(t, r.varint());
+        decode_items(r, t, i.items);
+    }
+}
+
+void decode_snapshot(string_view img, vector<Dispatch> &out){
+    BinReader r(img, BIN_DISPATCHES);
+    auto t = intern_table(StringTable::read(r));
+    out.resize(r.count());
+    for(auto &d: out){
+        d.number = r.str(); d.invoice_number = r.str(); d.date = r.str();
+        decode_items(r, t, d.items);
+    }
+}
+
+void decode_snapshot(string_view img, vector<tuple<string,string,long long>> &out){
+    BinReader r(img, BIN_CONSIGNMENT);
+    auto t = StringTable::read(r);
+    out.resize(r.count());
+    for(auto &e: out){
+        get<0>(e) = table_at(t, r.varint());
+        get<1>(e) = table_at(t, r.varint());
+        get<2>(e) = r.svarint();
+    }
+}
+
+/* ---------- Sequences ---------- */
+
+/*
+  Monotonic invoice/dispatch number allocator backed by counters.txt
+  ("<name> <last issued>" per line). reserve() holds a mutex and an
+  exclusive flock on the file while it reads, bumps and fsyncs the
+  counter, so threads and separate processes never hand out the same
+  number; batch imports reserve a whole range in one call.
+*/
+struct Sequences {
+    string path;
+    mutex mx;
+    map<string,long long> floor;   // highest number seen in loaded data
+
+    void observe(const string &name, long long n){
+        lock_guard<mutex> lk(mx);
+        long long &f = floor[name];
+        f = max(f, n);
+    }
+
+    // Returns the first of n consecutive unused numbers for name.
+    long long reserve(const string &name, long long n=1){
+        lock_guard<mutex> lk(mx);
+        map<string,long long> vals;
+#if defined(_WIN32)
+        read_values(slurp(), vals);
+        long long first = bump(name, n, vals);
+        write_atomic(path, format_values(vals));
+#else
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd<0) throw runtime_error("cannot open " + path);
+        flock(fd, LOCK_EX);
+        string data;
+        char buf[4096];
+        ssize_t r;
+        while((r = ::read(fd, buf, sizeof(buf)))>0) data.append(buf, r);
+        read_values(data, vals);
+        long long first = bump(name, n, vals);
+        // Overwritten in place, as the flock is on this inode. Counters only
+        // grow, so the new text is never shorter than the old and the file
+        // is not emptied at any point.
+        string out = format_values(vals);
+        if(pwrite(fd, out.data(), out.size(), 0)!=(ssize_t)out.size() || ftruncate(fd, out.size())!=0){
+            ::close(fd);
+            throw runtime_error("cannot write " + path);
+        }
+        fsync(fd);
+        ::close(fd);   // releases the flock
+#endif
+        return first;
+    }
+
+private:
+    long long bump(const string &name, long long n, map<string,long long> &vals){
+        long long &last = vals[name];
+        long long &f = floor[name];
+        last = max(last, f);
+        long long first = last+1;
+        last += n;
+        f = last;
+        return first;
+    }
+
+    string slurp() const {
+        ifstream f(path);
+        return string((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    }
+
+    static void read_values(const string &data, map<string,long long> &vals){
+        istringstream in(data);
+        string name;
+        long long v;
+        while(in >> name >> v) vals[name] = v;
+    }
+
+    static string format_values(const map<string,long long> &vals){
+        string out;
+        for(auto &kv: vals) out += kv.first + " " + to_string(kv.second) + "\n";
+        return out;
+    }
+};
+
+// Leading integer of an invoice/dispatch number, or -1 when it has none.
+long long number_value(string_view s){
+    s = trim_view(s);
+    long long v;
+    auto r = from_chars(s.data(), s.data()+s.size(), v);
+    return r.ec==errc() ? v : -1;
+}
+
+/* ---------- FileManager ---------- */
+
+// "YYYY-MM" of a "YYYY-MM-DD" date; records without one file under 0000-00.
+string month_of(string_view date){
+    auto digits = [&](size_t a, size_t b){
+        for(size_t i=a;i<b;++i) if(!isdigit((unsigned char)date[i])) return false;
+        return true;
+    };
+    if(date.size()>=7 && digits(0,4) && date[4]=='-' && digits(5,7)) return string(date.substr(0,7));
+    return "0000-00";
+}
+
+struct FileManager {
+    string products_file = "products.txt";
+    string customers_file = "customers.txt";
+    string invoices_file = "invoices.txt";
+    string dispatches_file = "dispatches.txt";
+    string admin_file = "admin.txt";
+    string consignment_file = "consignment.txt";
+    string journal_file = "journal.log";
+    string counters_file = "counters.txt";
+
+    // Journaled mode appends one record per mutation instead of rewriting the
+    // .txt snapshots; they are compacted on save_all() or once the journal
+    // holds compact_after records. --no-journal turns it off, and each
+    // commit then rewrites the snapshots it changed.
+    bool journaled = true;
+    size_t compact_after = 100000;
+    Journal journal;
+
+    Sequences sequences;
+
+    // Text files larger than parallel_min_bytes are cut at line boundaries
+    // and parsed by up to `threads` workers (0 = one per core).
+    unsigned threads = 0;
+    size_t parallel_min_bytes = 1<<20;
+
+    // A line that does not parse stops the load with "file:line: why",
+    // unless lenient, when it is logged and skipped. Skipped lines are
+    // gone from the file after the next save.
+    bool lenient = false;
+
+    struct BadLine { const char* at; string why; };
+
+    // Parses every record of text, read from path, with parse(fields, out),
+    // which returns what is wrong with the line or "". The work is split
+    // across threads; results keep the file order.
+    template<class T, class Parse>
+    vector<T> parse_records(const string &path, string_view text, Parse parse){
+        unsigned n = threads ? threads : max(1u, thread::hardware_concurrency());
+        n = (unsigned)min<size_t>(n, text.size()/max<size_t>(1, parallel_min_bytes/4));
+        auto run = [&parse](string_view chunk, vector<T> &v, vector<BadLine> &bad){
+            for_each_record(chunk, [&](const vector<string_view> &fields){
+                string why = parse(fields, v);
+                if(!why.empty()) bad.push_back({fields[0].data(), move(why)});
+            });
+        };
+        vector<T> out;
+        vector<BadLine> bad;
+        if(n<=1 || text.size()<parallel_min_bytes){
+            run(text, out, bad);
+            report_bad_lines(path, text, bad);
+            return out;
+        }
+
+        vector<size_t> cut{0};
+        for(unsigned k=1;k<n;++k){
+            size_t at = max(cut.back(), text.size()*k/n);
+            cut.push_back(min(text.size(), find_newline(text, at)+1));
+        }
+        cut.push_back(text.size());
+
+        vector<future<pair<vector<T>,vector<BadLine>>>> parts;
+        for(unsigned k=0;k<n;++k){
+            string_view chunk = text.substr(cut[k], cut[k+1]-cut[k]);
+            parts.push_back(async(launch::async, [chunk, &run]{
+                pair<vector<T>,vector<BadLine>> r;
+                run(chunk, r.first, r.second);
+                return r;
+            }));
+        }
+        vector<vector<T>> done;
+        size_t total=0;
+        for(auto &f: parts){
+            auto r = f.get();
+            done.push_back(move(r.first));
+            total += done.back().size();
+            move(r.second.begin(), r.second.end(), back_inserter(bad));
+        }
+        report_bad_lines(path, text, bad);
+        out.reserve(total);
+        for(auto &v: done) move(v.begin(), v.end(), back_inserter(out));
+        return out;
+    }
+
+    // bad is in file order, so line numbers are counted in one pass.
+    void report_bad_lines(const string &path, string_view text, const vector<BadLine> &bad) const {
+        size_t line = 1;
+        const char* counted = text.data();
+        for(auto &b: bad){
+            line += count(counted, b.at, '\n');
+            counted = b.at;
+            string msg = path + ":" + to_string(line) + ": " + b.why;
+            if(!lenient) throw runtime_error(msg + " (--lenient skips bad lines)");
+            cerr << msg + ", line skipped\n";
+        }
+    }
+
+    // Binary mode saves snapshots as <name>.bin and prefers them on load;
+    // the .txt files are used when no .bin exists. A .bin that does not
+    // decode stops the load: the .txt beside it is older, and saving that
+    // over the .bin would drop everything written since.
+    bool binary = false;
+
+    static string bin_path(const string &txt){
+        return txt.substr(0, txt.rfind('.')) + ".bin";
+    }
+
+    template<class T>
+    bool load_binary(const string &txt, vector<T> &out){
+        if(!binary) return false;
+        MappedFile f(bin_path(txt));
+        if(!f.size) return false;
+        try{
+            decode_snapshot(f.view(), out);
+            return true;
+        }catch(const exception &e){
+            throw runtime_error(bin_path(txt) + ": " + e.what()
+                                + " (restore it from a backup, or remove it to load " + txt + ")");
+        }
+    }
+
+    template<class T>
+    bool save_binary(const string &txt, const vector<T> &arr){
+        if(!binary) return false;
+        write_atomic(bin_path(txt), encode_snapshot(arr));
+        return true;
+    }
+
+    // Text snapshot with one line(record) per line, replaced atomically.
+    template<class T, class F>
+    static void save_lines(const string &path, const vector<T> &arr, F line){
+        string out;
+        for(auto &r: arr){ out += line(r); out += '\n'; }
+        write_atomic(path, out);
+    }
+
+    // Rewrites every snapshot in the other format (--txt-to-bin / --bin-to-txt).
+    void convert_snapshots(bool to_binary){
+        binary = !to_binary;
+        auto p = load_products();
+        auto c = load_customers();
+        auto k = load_consignment();
+        vector<pair<string,vector<Invoice>>> inv;
+        vector<pair<string,vector<Dispatch>>> dis;
+        for(auto &path: history_files(invoices_file, !to_binary)) inv.emplace_back(path, load_records<Invoice>(path));
+        for(auto &path: history_files(dispatches_file, !to_binary)) dis.emplace_back(path, load_records<Dispatch>(path));
+        binary = to_binary;
+        save_products(p);
+        save_customers(c);
+        save_consignment(k);
+        for(auto &f: inv) save_records(f.first, f.second);
+        for(auto &f: dis) save_records(f.first, f.second);
+    }
+
+    vector<Product> load_products(){
+        LatencyTimer t(M_LOAD_PRODUCTS);
+        vector<Product> out;
+        if(load_binary(products_file, out)) return out;
+        MappedFile f(products_file);
+        return parse_records<Product>(products_file, f.view(), [](const vector<string_view> &parts, vector<Product> &v){
+            Product p;
+            string why = Product::from_fields(parts, p);
+            if(why.empty()) v.push_back(move(p));
+            return why;
+        });
+    }
+
+    void save_products(const vector<Product>& arr){
+        LatencyTimer t(M_SAVE_PRODUCTS);
+        if(save_binary(products_file, arr)) return;
+        save_lines(products_file, arr, [](const Product &p){ return p.to_line(); });
+    }
+
+    vector<Customer> load_customers(){
+        LatencyTimer t(M_LOAD_CUSTOMERS);
+        vector<Customer> out;
+        if(load_binary(customers_file, out)) return out;
+        MappedFile f(customers_file);
+        return parse_records<Customer>(customers_file, f.view(), [](const vector<string_view> &parts, vector<Customer> &v){
+            Customer c;
+            string why = Customer::from_fields(parts, c);
+            if(why.empty()) v.push_back(move(c));
+            return why;
+        });
+    }
+
+    void save_customers(const vector<Customer>& arr){
+        LatencyTimer t(M_SAVE_CUSTOMERS);
+        if(save_binary(customers_file, arr)) return;
+        save_lines(customers_file, arr, [](const Customer &c){ return c.to_line(); });
+    }
+
+    /* ---------- History segments ---------- */
+
+    /*
+      Invoice and dispatch history is partitioned by month of the record's
+      date: history/invoices-2024-05.txt, history/dispatches-2024-05.txt
+      (.bin in binary mode). The App reads recent months at startup and
+      older ones when something asks for them, and rewrites only the
+      months that changed. invoices.txt / dispatches.txt from before
+      partitioning are read whole and replaced by segments on the next
+      save.
+    */
+    string history_dir = "history";
+
+    string segment_file(const string &base, const string &month) const {
+        size_t dot = base.rfind('.');
+        return history_dir + "/" + base.substr(0, dot) + "-" + month + base.substr(dot);
+    }
+
+    // Months with a segment of base on disk, in either format.
+    set<string> segment_months(const string &base) const {
+        set<string> out;
+        string stem = base.substr(0, base.rfind('.')) + "-";
+        error_code ec;
+        for(auto &e: filesystem::directory_iterator(history_dir, ec)){
+            string name = e.path().filename().string();
+            if(name.size()!=stem.size()+11 || name.compare(0, stem.size(), stem)!=0) continue;
+            string ext = name.substr(stem.size()+7);
+            if(ext==".txt" || ext==".bin") out.insert(name.substr(stem.size(), 7));
+        }
+        return out;
+    }
+
+    bool exists_any(const string &txt) const {
+        error_code ec;
+        return filesystem::exists(txt, ec) || filesystem::exists(bin_path(txt), ec);
+    }
+
+    // The unpartitioned file, if any, and every segment of base that has
+    // a copy in the given format.
+    vector<string> history_files(const string &base, bool in_binary) const {
+        vector<string> out;
+        auto present = [&](const string &txt){
+            error_code ec;
+            return filesystem::exists(in_binary ? bin_path(txt) : txt, ec);
+        };
+        if(present(base)) out.push_back(base);
+        for(auto &m: segment_months(base))
+            if(present(segment_file(base, m))) out.push_back(segment_file(base, m));
+        return out;
+    }
+
+    template<class T>
+    vector<T> load_records(const string &txt){
+        vector<T> out;
+        if(load_binary(txt, out)) return out;
+        MappedFile f(txt);
+        return parse_records<T>(txt, f.view(), [](const vector<string_view> &parts, vector<T> &v){
+            T r;
+            string why = T::from_fields(parts, r);
+            if(why.empty()) v.push_back(move(r));
+            return why;
+        });
+    }
+
+    template<class T>
+    void save_records(const string &txt, const vector<T> &arr){
+        if(save_binary(txt, arr)) return;
+        save_lines(txt, arr, [](const T &r){ return r.to_block(); });
+    }
+
+    // Records of base for the given months, oldest month first.
+    template<class T>
+    vector<T> read_segments(const string &base, const set<string> &months){
+        vector<T> out;
+        for(auto &m: months){
+            string path = segment_file(base, m);
+            if(!exists_any(path)) continue;
+            auto part = load_records<T>(path);
+            if(out.empty()) out = move(part);
+            else move(part.begin(), part.end(), back_inserter(out));
+        }
+        return out;
+    }
+
+    // An empty month has no segment file.
+    template<class T>
+    void save_segment(const string &base, const string &month, const vector<T> &arr){
+        LatencyTimer t(M_SAVE_MONTH);
+        string path = segment_file(base, month);
+        if(arr.empty()){
+            error_code ec;
+            filesystem::remove(path, ec);
+            filesystem::remove(bin_path(path), ec);
+            return;
+        }
+        filesystem::create_directories(history_dir);
+        save_records(path, arr);
+    }
+
+    /*
+      history/ranges.txt holds, per segment, the lowest and highest
+      numeric record number in it and whether it has any other number
+      ("invoices 2024-05 1201 1488 0"), so a lookup that misses the
+      months in memory reads only the months that can hold the number.
+      A month without a line, or with one that does not parse, can hold
+      anything and is read as before. Ranges only ever widen, and the
+      file is written before the segments it describes.
+    */
+    struct NumberRange {
+        long long lo = LLONG_MAX, hi = -1;
+        bool other = false;
+
+        void add(string_view num){
+            long long v = number_value(num);
+            if(v<0){ other = true; return; }
+            lo = min(lo, v);
+            hi = max(hi, v);
+        }
+        // v is number_value() of the number looked up.
+        bool may_hold(long long v) const {
+            return v<0 ? other : v>=lo && v<=hi;
+        }
+    };
+    using MonthRanges = map<string, NumberRange>;
+
+    string ranges_file() const { return history_dir + "/ranges.txt"; }
+
+    pair<MonthRanges,MonthRanges> load_ranges() const {
+        pair<MonthRanges,MonthRanges> out;
+        ifstream f(ranges_file());
+        string line, kind, month;
+        NumberRange r;
+        while(getline(f, line)){
+            istringstream in(line);
+            if(!(in >> kind >> month >> r.lo >> r.hi >> r.other)) continue;
+            if(kind=="invoices") out.first[month] = r;
+            else if(kind=="dispatches") out.second[month] = r;
+        }
+        return out;
+    }
+
+    void save_ranges(const MonthRanges &inv, const MonthRanges &dis){
+        string out;
+        for(auto *by: {&inv, &dis})
+            for(auto &kv: *by)
+                out += string(by==&inv ? "invoices " : "dispatches ") + kv.first + " "
+                     + to_string(kv.second.lo) + " " + to_string(kv.second.hi) + " "
+                     + (kv.second.other ? "1" : "0") + "\n";
+        filesystem::create_directories(history_dir);
+        write_atomic(ranges_file(), out);
+    }
+
+    struct History {
+        vector<Invoice> invoices;
+        vector<Dispatch> dispatches;
+        set<string> months;     // months with segments on disk
+        set<string> loaded;     // months read into invoices/dispatches
+        MonthRanges invoice_ranges, dispatch_ranges;
+        bool legacy = false;    // an unpartitioned file was read
+    };
+
+    // Reads the segments of every month from `from` on ("" for all). With
+    // an unpartitioned file present everything is read, since it and any
+    // segments came from the same data.
+    History load_history(const string &from){
+        LatencyTimer t(M_LOAD_HISTORY);
+        History h;
+        bool li = exists_any(invoices_file), ld = exists_any(dispatches_file);
+        h.legacy = li || ld;
+        h.months = segment_months(invoices_file);
+        for(auto &m: segment_months(dispatches_file)) h.months.insert(m);
+        for(auto &m: h.months)
+            if(h.legacy || m>=from) h.loaded.insert(m);
+        tie(h.invoice_ranges, h.dispatch_ranges) = load_ranges();
+
+        auto fi = async(launch::async, [&]{
+            return li ? load_records<Invoice>(invoices_file) : read_segments<Invoice>(invoices_file, h.loaded);
+        });
+        auto fd = async(launch::async, [&]{
+            return ld ? load_records<Dispatch>(dispatches_file) : read_segments<Dispatch>(dispatches_file, h.loaded);
+        });
+        h.invoices = fi.get();
+        h.dispatches = fd.get();
+        return h;
+    }
+
+    void remove_legacy_history(){
+        error_code ec;
+        for(auto *base: {&invoices_file, &dispatches_file}){
+            filesystem::remove(*base, ec);
+            filesystem::remove(bin_path(*base), ec);
+        }
+    }
+
+    pair<string,string> load_admin(){
+        ifstream f(admin_file);
+        string u,p;
+        if(!(f>>u>>p)){
+            u="admin"; p="admin";
+            ofstream out(admin_file);
+            out << u << " " << p << "\n";
+        }
+        return {u,p};
+    }
+
+    void save_admin(const string &u, const string &p){
+        write_atomic(admin_file, u + " " + p + "\n");
+    }
+
+    vector<tuple<string,string,long long>> load_consignment(){
+        LatencyTimer t(M_LOAD_CONSIGNMENT);
+        vector<tuple<string,string,long long>> out;
+        if(load_binary(consignment_file, out)) return out;
+        MappedFile f(consignment_file);
+        return parse_records<tuple<string,string,long long>>(consignment_file, f.view(),
+            [](const vector<string_view> &parts, vector<tuple<string,string,long long>> &v) -> string {
+                long long qty;
+                if(parts.size()<3) return "expected 3 fields, found " + to_string(parts.size());
+                if(!parse_qty(parts[2], qty)) return "qty is not a whole number";
+                v.emplace_back(string(parts[0]), string(parts[1]), qty);
+                return "";
+            });
+    }
+
+    void save_consignment(const vector<tuple<string,string,long long>>& arr){
+        LatencyTimer t(M_SAVE_CONSIGNMENT);
+        if(save_binary(consignment_file, arr)) return;
+        save_lines(consignment_file, arr, [](const tuple<string,string,long long> &t){
+            return get<0>(t) + "," + get<1>(t) + "," + to_string(get<2>(t));
+        });
+    }
+};
+
+/* ---------- Code Index ---------- */
+
+/*
+  Open-addressing (linear probing) hash table mapping a record key such as
+  Product::code or Invoice::number to its position in the owning vector.
+  Each slot stores the full hash, so a probe only compares strings when the
+  hashes match. Keys are not copied: they are read back from the vector.
+*/
+template<class T>
+struct CodeIndex {
+    static constexpr size_t EMPTY = SIZE_MAX;
+    struct Slot { size_t hash; size_t pos; };
+
+    string T::* key;
+    const vector<T>* vec = nullptr;
+    vector<Slot> slots;
+    size_t used = 0;
+
+    explicit CodeIndex(string T::* k): key(k) {}
+
+    static size_t hash_of(const string &s){ return std::hash<string>{}(s); }
+
+    const string& key_at(size_t pos) const { return (*vec)[pos].*key; }
+
+    size_t probe(const string &k, size_t h) const {
+        size_t mask = slots.size()-1;
+        size_t i = h & mask;
+        while(slots[i].pos!=EMPTY){
+            if(slots[i].hash==h && key_at(slots[i].pos)==k) return i;
+            i = (i+1) & mask;
+        }
+        return i;
+    }
+
+    // Returns the vector position of k, or EMPTY.
+    size_t find(const string &k) const {
+        if(slots.empty()) return EMPTY;
+        return slots[probe(k, hash_of(k))].pos;
+    }
+
+    // Indexes vec[pos]; an existing entry with the same key wins, matching
+    // the first-match behaviour of a linear scan.
+    void insert(size_t pos){
+        if((used+1)*10 > slots.size()*7) grow();
+        const string &k = key_at(pos);
+        size_t h = hash_of(k);
+        size_t i = probe(k, h);
+        if(slots[i].pos!=EMPTY) return;
+        slots[i] = {h, pos};
+        used++;
+    }
+
+    void erase(const string &k){
+        if(slots.empty()) return;
+        size_t mask = slots.size()-1;
+        size_t i = probe(k, hash_of(k));
+        if(slots[i].pos==EMPTY) return;
+        // Backward-shift deletion keeps probe chains intact without tombstones.
+        size_t j = i;
+        while(true){
+            j = (j+1) & mask;
+            if(slots[j].pos==EMPTY) break;
+            size_t home = slots[j].hash & mask;
+            if(((j-home) & mask) >= ((j-i) & mask)){
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i].pos = EMPTY;
+        used--;
+    }
+
+    // Room for n keys without growing.
+    void reserve(size_t n){
+        while(n*10 > slots.size()*7) grow();
+    }
+
+    // Positions renumbered by compacting the vector: to[pos] is the new
+    // position, or EMPTY for a record that was dropped. Keys, and so
+    // hashes, are unchanged; dropped entries would leave holes in probe
+    // chains, so if there are any the table is re-laid.
+    void remap(const vector<size_t> &to){
+        size_t dropped = 0;
+        for(auto &s: slots){
+            if(s.pos==EMPTY) continue;
+            s.pos = to[s.pos];
+            if(s.pos==EMPTY) dropped++;
+        }
+        if(!dropped) return;
+        used -= dropped;
+        relay(slots.size());
+    }
+
+    void rebuild(const vector<T> &v){
+        vec = &v;
+        size_t cap = 16;
+        while(cap*7 < v.size()*10) cap <<= 1;
+        slots.assign(cap, Slot{0, EMPTY});
+        used = 0;
+        for(size_t i=0;i<v.size();++i) insert(i);
+    }
+
+    void grow(){ relay(max<size_t>(16, slots.size()*2)); }
+
+    void relay(size_t cap){
+        vector<Slot> old;
+        old.swap(slots);
+        slots.assign(cap, Slot{0, EMPTY});
+        size_t mask = slots.size()-1;
+        for(auto &sl: old){
+            if(sl.pos==EMPTY) continue;
+            size_t i = sl.hash & mask;
+            while(slots[i].pos!=EMPTY) i = (i+1) & mask;
+            slots[i] = sl;
+        }
+    }
+};
+
+/*
+  Deleted slots of a record vector (tombstones), kept for reuse by the
+  next insert. The list gives the reuse order and the bitmap answers
+  "is slot i deleted" without looking at the record, whose fields may
+  legitimately be empty.
+*/
+struct FreeSlots {
+    vector<size_t> list;
+    vector<uint8_t> gone;
+
+    bool empty() const { return list.empty(); }
+    size_t size() const { return list.size(); }
+    bool has(size_t i) const { return i<gone.size() && gone[i]; }
+
+    void clear(){ list.clear(); gone.clear(); }
+
+    void add(size_t i){
+        if(i>=gone.size()) gone.resize(i+1, 0);
+        gone[i] = 1;
+        list.push_back(i);
+    }
+
+    size_t take(){
+        size_t i = list.back();
+        list.pop_back();
+        gone[i] = 0;
+        return i;
+    }
+};
+
+/* ---------- Report Views ---------- */
+
+/*
+  Reports are kept as formatted rows. A mutation only marks its row
+  stale and the next view reformats just those, so showing a report
+  after a sale costs one row of formatting, not one per SKU. Rows are
+  built with to_chars and plain appends, and written through BulkWriter
+  instead of iostream.
+*/
+
+// Buffered FILE* writer, flushing in 1 MB pieces. A null FILE* discards.
+struct BulkWriter {
+    FILE* f;
+    bool own = false;
+    string buf;
+
+    explicit BulkWriter(const string &path): f(fopen(path.c_str(), "wb")), own(true) {
+        if(!f) throw runtime_error("cannot write " + path);
+    }
+    explicit BulkWriter(FILE* out): f(out) {}
+    ~BulkWriter(){ flush(); if(own) fclose(f); }
+
+    BulkWriter& operator<<(string_view s){ buf.append(s.data(), s.size()); if(buf.size()>(1<<20)) flush(); return *this; }
+    BulkWriter& operator<<(long long v){ char b[24]; return *this << string_view(b, to_chars(b, b+sizeof(b), v).ptr - b); }
+    void flush(){ if(f && !buf.empty()) fwrite(buf.data(), 1, buf.size(), f); buf.clear(); }
+};
+
+// s left-aligned in a field of width w, like left << setw(w).
+inline void put_field(string &out, string_view s, size_t w){
+    out.append(s.data(), s.size());
+    if(s.size()<w) out.append(w-s.size(), ' ');
+}
+
+inline void put_int(string &out, long long v){
+    char b[24];
+    out.append(b, to_chars(b, b+sizeof(b), v).ptr - b);
+}
+
+// Formatted rows by slot with stale flags. mark() may run on several
+// session threads at once; refresh() runs on the viewing thread.
+struct RowCache {
+    vector<string> rows;
+    vector<uint8_t> stale;
+    atomic<bool> any{false};
+
+    void reset(size_t n){ rows.assign(n, string()); stale.assign(n, 1); any = true; }
+    void push(){ rows.emplace_back(); stale.push_back(1); any = true; }
+
+    void mark(size_t i){
+        shared_ref(stale[i]).store(1, memory_order_relaxed);
+        any.store(true, memory_order_release);
+    }
+
+    // Calls format(i, row) for every stale row, row cleared beforehand.
+    template<class F>
+    void refresh(F format){
+        if(!any.exchange(false, memory_order_acquire)) return;
+        for(size_t i=0;i<rows.size();++i)
+            if(shared_ref(stale[i]).exchange(0, memory_order_relaxed)){
+                rows[i].clear();
+                format(i, rows[i]);
+            }
+    }
+};
+
+/*
+  Ordering of a table's slots by a key (code, name, stock), for listings
+  read a page at a time. Entries (key, slot) live in a sorted main array
+  plus a small sorted delta. A change only flags its slot; the next read
+  files the flagged slots into the delta, leaving their main entries
+  dead, and once the delta and dead entries pass 1/8 of the table main is
+  rebuilt by one merge. A page starts from a cursor, the entry of the
+  last row shown, so it costs a binary search plus the rows returned.
+  Deleted slots are dropped until reused, and compaction renumbers the
+  entries in place since it keeps the survivors' order.
+*/
+template<class Key>
+struct OrderedIndex {
+    using Entry = pair<Key,uint32_t>;
+    enum : uint8_t { NONE, MAIN, DELTA, GONE };
+
+    vector<Entry> main, delta;
+    vector<uint8_t> where;          // by slot: which array holds its live entry
+    size_t dead = 0;                // main entries of slots now in delta
+    bool delta_gone = false;        // delta holds entries of dropped slots
+    vector<uint8_t> stale;          // by slot, set by mark() from any thread
+    vector<uint32_t> pending;       // slots flagged since the last read
+    mutex pending_mx, mx;
+
+    // n slots, all to be filed on the first read.
+    void reset(size_t n){
+        main.clear(); delta.clear(); dead = 0;
+        where.assign(n, NONE);
+        stale.assign(n, 1);
+        pending.resize(n);
+        iota(pending.begin(), pending.end(), 0);
+    }
+
+    void push(){
+        where.push_back(NONE);
+        stale.push_back(1);
+        pending.push_back((uint32_t)where.size()-1);
+    }
+
+    void mark(size_t i){
+        if(shared_ref(stale[i]).exchange(1, memory_order_acq_rel)) return;
+        lock_guard<mutex> lk(pending_mx);
+        pending.push_back((uint32_t)i);
+    }
+
+    // A deleted slot, and one taken again by an insert.
+    void drop(size_t i){
+        lock_guard<mutex> lk(mx);
+        if(where[i]==MAIN) dead++;
+        else if(where[i]==DELTA) delta_gone = true;
+        where[i] = GONE;
+    }
+
+    void revive(size_t i){
+        {
+            lock_guard<mutex> lk(mx);
+            where[i] = NONE;
+        }
+        mark(i);
+    }
+
+    // Slots renumbered by compaction: to[i] is the new slot of i, or
+    // SIZE_MAX if it was dropped; n slots remain.
+    void remap(const vector<size_t> &to, size_t n){
+        lock_guard<mutex> lk(mx), lp(pending_mx);
+        vector<uint8_t> w(n, NONE), st(n, 0);
+        auto keep = [&](vector<Entry> &v, uint8_t in){
+            size_t k = 0;
+            for(auto &e: v){
+                if(where[e.second]!=in || to[e.second]==SIZE_MAX) continue;
+                uint32_t j = (uint32_t)to[e.second];
+                w[j] = in;
+                v[k++] = Entry(move(e.first), j);
+            }
+            v.resize(k);
+        };
+        keep(main, MAIN);
+        keep(delta, DELTA);
+        dead = 0;
+        delta_gone = false;
+        size_t k = 0;
+        for(uint32_t i: pending)
+            if(to[i]!=SIZE_MAX){ st[to[i]] = 1; pending[k++] = (uint32_t)to[i]; }
+        pending.resize(k);
+        where.swap(w);
+        stale.swap(st);
+    }
+
+    // Up to n entries following `after` (from the start if null) in key
+    // order, ties by slot. key_of(slot) gives a slot's current key.
+    template<class F>
+    vector<Entry> page(F key_of, const Entry* after, size_t n){
+        lock_guard<mutex> lk(mx);
+        refresh(key_of);
+        auto im = after ? upper_bound(main.begin(), main.end(), *after) : main.begin();
+        auto id = after ? upper_bound(delta.begin(), delta.end(), *after) : delta.begin();
+        vector<Entry> out;
+        while(out.size()<n){
+            while(im!=main.end() && where[im->second]!=MAIN) ++im;
+            while(id!=delta.end() && where[id->second]!=DELTA) ++id;
+            if(im==main.end() && id==delta.end()) break;
+            if(id==delta.end() || (im!=main.end() && *im < *id)) out.push_back(*im++);
+            else out.push_back(*id++);
+        }
+        return out;
+    }
+
+private:
+    template<class F>
+    void refresh(F key_of){
+        vector<uint32_t> changed;
+        {
+            lock_guard<mutex> lk(pending_mx);
+            changed.swap(pending);
+        }
+        if(changed.empty()) return;
+        // Cleared before the keys are read, so a change racing with this
+        // read flags the slot again.
+        for(uint32_t s: changed) shared_ref(stale[s]).store(0, memory_order_release);
+
+        bool moved = delta_gone;
+        for(uint32_t s: changed){
+            if(where[s]==MAIN) dead++;
+            else if(where[s]==DELTA) moved = true;
+            if(where[s]!=GONE) where[s] = NONE;
+        }
+        if(moved)
+            delta.erase(remove_if(delta.begin(), delta.end(), [&](const Entry &e){ return where[e.second]!=DELTA; }),
+                        delta.end());
+        delta_gone = false;
+        size_t old = delta.size();
+        for(uint32_t s: changed){
+            if(where[s]==GONE) continue;
+            delta.emplace_back(key_of(s), s);
+            where[s] = DELTA;
+        }
+        sort(delta.begin()+old, delta.end());
+        inplace_merge(delta.begin(), delta.begin()+old, delta.end());
+
+        if(delta.size() + dead > main.size()/8 + 64) fold();
+    }
+
+    void fold(){
+        vector<Entry> out;
+        out.reserve(main.size() - dead + delta.size());
+        auto im = main.begin();
+        for(auto &e: delta){
+            for(; im!=main.end() && *im < e; ++im)
+                if(where[im->second]==MAIN) out.push_back(move(*im));
+            out.push_back(move(e));
+        }
+        for(; im!=main.end(); ++im)
+            if(where[im->second]==MAIN) out.push_back(move(*im));
+        main.swap(out);
+        delta.clear();
+        dead = 0;
+        for(auto &e: main) where[e.second] = MAIN;
+    }
+};
+
+/* ---------- Consignment Store ---------- */
+
+/*
+  Consignment entries (customer, product, qty) in file order, keyed by
+  interned code ids. The store indexes them by (customer, product) for
+  merging and by customer for the customer view, and keeps running
+  per-product totals sorted by code for the report, each with its
+  formatted row. Duplicate pairs read from an old file stay separate
+  entries, and merges go to the first one, as before.
+*/
+struct ConsignmentStore {
+    struct Entry { uint32_t customer, product; long long qty; };
+
+    vector<Entry> entries;
+    unordered_map<uint64_t, size_t> by_pair;
+    unordered_map<uint32_t, vector<size_t>> by_customer;
+
+    struct Total { long long qty = 0; string row; bool stale = true; };
+    map<string,Total> product_totals;
+
+    static uint64_t pair_key(uint32_t cc, uint32_t pc){ return (uint64_t)cc<<32 | pc; }
+
+    void clear(){
+        entries.clear();
+        by_pair.clear();
+        by_customer.clear();
+        product_totals.clear();
+    }
+
+    void load(const vector<tuple<string,string,long long>> &rows){
+        clear();
+        entries.reserve(rows.size());
+        for(auto &t: rows) append(codes.intern(get<0>(t)), codes.intern(get<1>(t)), get<2>(t));
+    }
+
+    vector<tuple<string,string,long long>> rows() const {
+        vector<tuple<string,string,long long>> out;
+        out.reserve(entries.size());
+        for(auto &e: entries) out.emplace_back(codes.str(e.customer), codes.str(e.product), e.qty);
+        return out;
+    }
+
+    // Adds qty to the pair and returns its new total.
+    long long add(uint32_t cc, uint32_t pc, long long qty){
+        auto it = by_pair.find(pair_key(cc, pc));
+        if(it==by_pair.end()){ append(cc, pc, qty); return qty; }
+        Entry &e = entries[it->second];
+        e.qty += qty;
+        bump_total(pc, qty);
+        return e.qty;
+    }
+
+    // Sets the pair's quantity (journal replay).
+    void set(uint32_t cc, uint32_t pc, long long qty){
+        auto it = by_pair.find(pair_key(cc, pc));
+        if(it==by_pair.end()){ append(cc, pc, qty); return; }
+        Entry &e = entries[it->second];
+        bump_total(pc, qty - e.qty);
+        e.qty = qty;
+    }
+
+    // Rows of the by-product report, in code order, reformatting only
+    // the totals that changed since the last call.
+    vector<const string*> total_rows(){
+        vector<const string*> out;
+        out.reserve(product_totals.size());
+        for(auto &kv: product_totals){
+            Total &t = kv.second;
+            if(t.stale){
+                t.row.clear();
+                put_field(t.row, kv.first, 10);
+                put_int(t.row, t.qty);
+                t.row.push_back('\n');
+                t.stale = false;
+            }
+            out.push_back(&t.row);
+        }
+        return out;
+    }
+
+    const vector<size_t>& for_customer(uint32_t cc) const {
+        static const vector<size_t> none;
+        auto it = by_customer.find(cc);
+        return it==by_customer.end() ? none : it->second;
+    }
+
+private:
+    void append(uint32_t cc, uint32_t pc, long long qty){
+        size_t i = entries.size();
+        entries.push_back({cc, pc, qty});
+        by_pair.emplace(pair_key(cc, pc), i);
+        by_customer[cc].push_back(i);
+        bump_total(pc, qty);
+    }
+
+    void bump_total(uint32_t pc, long long delta){
+        Total &t = product_totals[codes.str(pc)];
+        t.qty += delta;
+        t.stale = true;
+    }
+};
+
+/* ---------- Product Columns ---------- */
+
+// Append-only byte pool; replaced strings become garbage until the owner
+// rebuilds the pool.
+struct StringPool {
+    struct Ref { uint64_t off; uint32_t len; };
+
+    string bytes;
+    size_t garbage = 0;
+
+    Ref add(string_view s){
+        Ref r{bytes.size(), (uint32_t)s.size()};
+        bytes.append(s.data(), s.size());
+        return r;
+    }
+
+    void replace(Ref &r, string_view s){
+        garbage += r.len;
+        r = add(s);
+    }
+
+    string_view get(Ref r) const { return string_view(bytes.data()+r.off, r.len); }
+
+    void clear(){ bytes.clear(); garbage = 0; }
+};
+
+/*
+  Struct-of-arrays mirror of App::products for scans and aggregates:
+  slot i describes products[i]. Quantities are a dense int64 column,
+  codes are ids in the global code table, and names/descriptions live in
+  one contiguous pool, so stock queries only stream the qty column. The
+  inventory report rows are materialized here too, since every product
+  change already passes through. A deleted product's slot is flagged
+  dead, cleared and left out of the orderings until an insert reuses it.
+*/
+struct ProductColumns {
+    vector<long long> qty;
+    vector<uint32_t> code_id;
+    vector<StringPool::Ref> name, description;
+    vector<uint8_t> dead;       // 1 for a deleted slot
+    StringPool pool;
+    RowCache rows;
+    OrderedIndex<string> by_code, by_name;
+    OrderedIndex<long long> by_qty;
+
+    size_t size() const { return qty.size(); }
+
+    const string& code(size_t slot) const { return codes.str(code_id[slot]); }
+    bool live(size_t slot) const { return !dead[slot]; }
+
+    void reserve(size_t n){
+        qty.reserve(n);
+        code_id.reserve(n);
+        name.reserve(n);
+        description.reserve(n);
+        dead.reserve(n);
+        rows.rows.reserve(n);
+    }
+
+    void build(const vector<Product> &arr, const FreeSlots &gone){
+        qty.clear(); code_id.clear(); name.clear(); description.clear(); dead.clear();
+        pool.clear();
+        size_t bytes = 0;
+        for(auto &p: arr) bytes += p.name.size() + p.description.size();
+        pool.bytes.reserve(bytes);
+        qty.reserve(arr.size());
+        code_id.reserve(arr.size());
+        name.reserve(arr.size());
+        description.reserve(arr.size());
+        dead.reserve(arr.size());
+        rows.reset(0);
+        by_code.reset(0);
+        by_name.reset(0);
+        by_qty.reset(0);
+        for(auto &p: arr) push(p);
+        for(size_t i: gone.list){ dead[i] = 1; drop_orders(i); }
+    }
+
+    void push(const Product &p){
+        qty.push_back(p.qty);
+        code_id.push_back(codes.intern(p.code));
+        name.push_back(pool.add(p.name));
+        description.push_back(pool.add(p.description));
+        dead.push_back(0);
+        rows.push();
+        by_code.push();
+        by_name.push();
+        by_qty.push();
+    }
+
+    void drop_orders(size_t slot){
+        by_code.drop(slot);
+        by_name.drop(slot);
+        by_qty.drop(slot);
+    }
+
+    // Slot emptied by a delete, and taken again by an insert.
+    void kill(size_t slot){
+        qty[slot] = 0;
+        code_id[slot] = 0;
+        dead[slot] = 1;
+        pool.replace(name[slot], "");
+        pool.replace(description[slot], "");
+        rows.mark(slot);
+        drop_orders(slot);
+    }
+
+    void assign(size_t slot, const Product &p){
+        qty[slot] = p.qty;
+        code_id[slot] = codes.intern(p.code);
+        dead[slot] = 0;
+        pool.replace(name[slot], p.name);
+        pool.replace(description[slot], p.description);
+        rows.mark(slot);
+        by_code.revive(slot);
+        by_name.revive(slot);
+        by_qty.revive(slot);
+    }
+
+    // Slots renumbered by App::compact_products(), in one pass over each
+    // column: to[i] is the new slot of i, or SIZE_MAX for a deleted one.
+    void compact(const vector<size_t> &to, size_t n){
+        for(size_t i=0;i<to.size();++i){
+            size_t j = to[i];
+            if(j==SIZE_MAX || j==i) continue;
+            qty[j] = qty[i];
+            code_id[j] = code_id[i];
+            name[j] = name[i];
+            description[j] = description[i];
+            dead[j] = dead[i];
+            rows.rows[j] = move(rows.rows[i]);
+            rows.stale[j] = rows.stale[i];
+        }
+        qty.resize(n);
+        code_id.resize(n);
+        name.resize(n);
+        description.resize(n);
+        dead.resize(n);
+        rows.rows.resize(n);
+        rows.stale.resize(n);
+        by_code.remap(to, n);
+        by_name.remap(to, n);
+        by_qty.remap(to, n);
+    }
+
+    // Re-reads every column of slot from p (edits and journal upserts).
+    void update(size_t slot, const Product &p){
+        qty[slot] = p.qty;
+        if(pool.get(name[slot])!=p.name){ pool.replace(name[slot], p.name); by_name.mark(slot); }
+        if(pool.get(description[slot])!=p.description) pool.replace(description[slot], p.description);
+        rows.mark(slot);
+        by_qty.mark(slot);
+    }
+
+    // Stock deltas from concurrent sessions.
+    void add_qty(size_t slot, long long delta){
+        shared_ref(qty[slot]).fetch_add(delta, memory_order_relaxed);
+        rows.mark(slot);
+        by_qty.mark(slot);
+    }
+
+    // Pages by code, name or stock (lowest first); see OrderedIndex::page().
+    vector<pair<string,uint32_t>> page_by_code(const pair<string,uint32_t>* after, size_t n){
+        return by_code.page([&](size_t i){ return code(i); }, after, n);
+    }
+    vector<pair<string,uint32_t>> page_by_name(const pair<string,uint32_t>* after, size_t n){
+        return by_name.page([&](size_t i){ return string(pool.get(name[i])); }, after, n);
+    }
+    vector<pair<long long,uint32_t>> page_by_qty(const pair<long long,uint32_t>* after, size_t n){
+        return by_qty.page([&](size_t i){ return shared_ref(qty[i]).load(memory_order_relaxed); }, after, n);
+    }
+
+    // One inventory report line; none for a deleted slot.
+    void format_row(size_t i, string &r) const {
+        if(!live(i)) return;
+        put_field(r, code(i), 10);
+        put_field(r, pool.get(name[i]), 20);
+        size_t at = r.size();
+        put_int(r, shared_ref(qty[i]).load(memory_order_relaxed));
+        if(r.size()-at<10) r.append(10-(r.size()-at), ' ');
+        r.append(pool.get(description[i]));
+        r.push_back('\n');
+    }
+
+    // Inventory report rows, brought up to date.
+    const vector<string>& report_rows(){
+        rows.refresh([&](size_t i, string &r){ format_row(i, r); });
+        return rows.rows;
+    }
+
+    bool needs_compaction() const { return pool.garbage > (1<<20) && pool.garbage*2 > pool.bytes.size(); }
+
+    long long total_stock() const {
+        long long t = 0;
+        for(long long q: qty) t += q;
+        return t;
+    }
+};
+
+/* ---------- Search Index ---------- */
+
+/*
+  Substring search over the text fields of a table. Each document (a
+  product or customer, keyed by its interned code id) is kept lowercased,
+  and every trigram in it maps to the sorted ids of the documents holding
+  it. A query is split into words, and a document matches when it
+  contains every one of them, in any order or field. The lists of the
+  words' trigrams are intersected, walking the shortest and probing the
+  others, and each candidate is confirmed with a substring check per
+  word. Queries with no word of three characters scan the texts instead.
+  The index is built on the first search; from then on the table's
+  insert, change and erase paths keep it current, touching only the
+  trigrams that differ between the old and new text.
+*/
+struct TextIndex {
+    vector<string> text;                                  // by id; "" = absent
+    unordered_map<uint32_t, vector<uint32_t>> postings;   // trigram -> ids
+    size_t removed = 0;                                   // ids left in postings by remove()
+    atomic<bool> built{false};
+    mutex build_mx;
+
+    static string fold(string_view s){
+        string out(s);
+        for(char &c: out) c = (char)tolower((unsigned char)c);
+        return out;
+    }
+
+    // Distinct trigrams of t, sorted.
+    static vector<uint32_t> trigrams(const string &t){
+        vector<uint32_t> out;
+        for(size_t i=0;i+3<=t.size();++i) out.push_back(trigram_at(t, i));
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+        return out;
+    }
+
+    // Adds, replaces or (with "") removes the document of id. A no-op until
+    // the index is built.
+    void set(uint32_t id, string_view raw){
+        if(!built.load(memory_order_acquire)) return;
+        string t = fold(raw);
+        if(id>=text.size()) text.resize(id+1);
+        if(text[id]==t) return;
+        vector<uint32_t> old = trigrams(text[id]), now = trigrams(t);
+        vector<uint32_t> gone, added;
+        set_difference(old.begin(), old.end(), now.begin(), now.end(), back_inserter(gone));
+        set_difference(now.begin(), now.end(), old.begin(), old.end(), back_inserter(added));
+        for(uint32_t g: gone){
+            auto it = postings.find(g);
+            if(it==postings.end()) continue;
+            auto &ids = it->second;
+            auto pos = lower_bound(ids.begin(), ids.end(), id);
+            if(pos!=ids.end() && *pos==id) ids.erase(pos);
+            if(ids.empty()) postings.erase(it);
+        }
+        for(uint32_t g: added){
+            auto &ids = postings[g];
+            if(ids.empty() || ids.back()<id){ ids.push_back(id); continue; }
+            auto pos = lower_bound(ids.begin(), ids.end(), id);
+            if(*pos!=id) ids.insert(pos, id);
+        }
+        text[id] = move(t);
+    }
+
+    // A deleted document stays in its lists, where search() skips it by its
+    // empty text, until deletions reach a quarter of the index and one
+    // sweep drops them all: erasing from the long lists of common trigrams
+    // one delete at a time would cost a pass over the table each.
+    void remove(uint32_t id){
+        if(!built.load(memory_order_acquire) || id>=text.size() || text[id].empty()) return;
+        text[id].clear();
+        if(++removed*4 > text.size()) purge();
+    }
+
+    void purge(){
+        for(auto it=postings.begin(); it!=postings.end(); ){
+            auto &ids = it->second;
+            ids.erase(remove_if(ids.begin(), ids.end(), [&](uint32_t id){ return text[id].empty(); }), ids.end());
+            if(ids.empty()) it = postings.erase(it);
+            else ++it;
+        }
+        removed = 0;
+    }
+
+    static uint32_t trigram_at(const string &t, size_t i){
+        return (uint32_t)(unsigned char)t[i]<<16 | (uint32_t)(unsigned char)t[i+1]<<8 | (unsigned char)t[i+2];
+    }
+
+    // Builds the index once; fill(add) calls add(id, text) per document.
+    // Searches may run on several sessions at once, so this is guarded.
+    // Each worker owns the trigrams g with g % workers == its number and
+    // walks the documents in id order, so its lists come out sorted.
+    template<class F>
+    void ensure_built(F fill){
+        if(built.load(memory_order_acquire)) return;
+        lock_guard<mutex> lk(build_mx);
+        if(built.load(memory_order_relaxed)) return;
+        text.clear();
+        postings.clear();
+        removed = 0;
+        fill([&](uint32_t id, string_view raw){
+            if(id>=text.size()) text.resize(id+1);
+            text[id] = raw;
+        });
+
+        unsigned workers = max(1u, min(8u, thread::hardware_concurrency()));
+        vector<unordered_map<uint32_t, vector<uint32_t>>> parts(workers);
+        vector<thread> pool;
+        for(unsigned w=0;w<workers;++w)
+            pool.emplace_back([&, w]{
+                for(size_t id=w; id<text.size(); id+=workers)
+                    for(char &c: text[id]) c = (char)tolower((unsigned char)c);
+            });
+        for(auto &th: pool) th.join();
+        pool.clear();
+        for(unsigned w=0;w<workers;++w)
+            pool.emplace_back([&, w]{
+                auto &part = parts[w];
+                for(uint32_t id=0; id<text.size(); ++id){
+                    const string &t = text[id];
+                    for(size_t i=0;i+3<=t.size();++i){
+                        uint32_t g = trigram_at(t, i);
+                        if(g % workers != w) continue;
+                        auto &ids = part[g];
+                        if(ids.empty() || ids.back()!=id) ids.push_back(id);
+                    }
+                }
+            });
+        for(auto &th: pool) th.join();
+        for(auto &part: parts)
+            for(auto &kv: part) postings.emplace(kv.first, move(kv.second));
+        built.store(true, memory_order_release);
+    }
+
+    // Up to limit ids whose text contains every word of query
+    // (case-insensitive), in id order.
+    vector<uint32_t> search(string_view query, size_t limit) const {
+        string q = fold(query);
+        vector<string> words;
+        for(size_t i=0, j; i<q.size(); i=j){
+            while(i<q.size() && is_blank(q[i])) i++;
+            for(j=i; j<q.size() && !is_blank(q[j]); ++j) {}
+            if(j>i) words.push_back(q.substr(i, j-i));
+        }
+        vector<uint32_t> out;
+        if(words.empty() || !limit) return out;
+        auto matches = [&](uint32_t id){
+            for(auto &w: words)
+                if(text[id].find(w)==string::npos) return false;
+            return true;
+        };
+        vector<uint32_t> grams;
+        for(auto &w: words){
+            auto g = trigrams(w);
+            grams.insert(grams.end(), g.begin(), g.end());
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        if(grams.empty()){
+            for(uint32_t id=0; id<text.size() && out.size()<limit; ++id)
+                if(!text[id].empty() && matches(id)) out.push_back(id);
+            return out;
+        }
+        vector<const vector<uint32_t>*> lists;
+        for(uint32_t g: grams){
+            auto it = postings.find(g);
+            if(it==postings.end()) return out;
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](auto *a, auto *b){ return a->size() < b->size(); });
+        for(uint32_t id: *lists[0]){
+            bool all = true;
+            for(size_t k=1; k<lists.size() && all; ++k)
+                all = binary_search(lists[k]->begin(), lists[k]->end(), id);
+            if(all && matches(id)){
+                out.push_back(id);
+                if(out.size()>=limit) break;
+            }
+        }
+        return out;
+    }
+};
+
+/* ---------- Application ---------- */
+
+// Startup settings taken from the command line.
+struct Options {
+    bool binary = false;
+    unsigned threads = 0;
+    unsigned recent_months = 3;   // history months read at startup, 0 = all
+    unsigned commit_window_us = 0;   // group commit wait for other sessions
+    bool lenient = false;   // skip and log lines that do not parse
+    bool journal = true;    // false: rewrite the changed snapshots on every commit
+};
+
+struct App {
+    FileManager fm;
+    vector<Product> products;
     vector<Customer> customers;
     vector<Invoice> invoices;
     vector<Dispatch> dispatches;
-    vector<tuple<string,string,long long>> consignment;
+    ConsignmentStore consignment;
+    ProductColumns columns;
+
+    CodeIndex<Product> product_index{&Product::code};
+    CodeIndex<Customer> customer_index{&Customer::code};
+    CodeIndex<Invoice> invoice_index{&Invoice::number};
+    CodeIndex<Dispatch> dispatch_index{&Dispatch::number};
+
+    // invoice number -> product code id -> quantity dispatched so far.
+    unordered_map<string, map<uint32_t,long long>> dispatched_index;
+
+    // product code id -> slot in products, for joins from invoice items.
+    static constexpr size_t NO_SLOT = SIZE_MAX;
+    vector<size_t> product_slot;
+
+    // Name/description and name/phone/address search, by code id.
+    TextIndex product_search, customer_search;
+
+    // Customers by code and by name, by position in customers; the
+    // product orderings live in columns.
+    OrderedIndex<string> customer_by_code, customer_by_name;
+
+    // Slots of deleted products and customers (tombstones), reused by
+    // inserts. More than 1/TOMBSTONE_RATIO of a table in tombstones
+    // compacts it.
+    static constexpr size_t TOMBSTONE_RATIO = 4;
+    FreeSlots free_products, free_customers;
+
+    // History months: those with records on disk or in memory, those read
+    // in, and those to rewrite on the next save. Positions of each month's
+    // records in invoices/dispatches are kept for saving and range queries.
+    set<string> history_months, loaded_months, dirty_months;
+    map<string, vector<size_t>> invoice_months, dispatch_months;
+    FileManager::MonthRanges invoice_ranges, dispatch_ranges;   // see FileManager
+    bool legacy_history = false;
+    unsigned recent_months = 3;
+
+    string admin_user, admin_pass;
+
+    // Collections to rewrite on commit() when the journal is disabled.
+    enum { D_PRODUCTS=1, D_CUSTOMERS=2, D_INVOICES=4, D_DISPATCHES=8, D_CONSIGNMENT=16 };
+    atomic<unsigned> dirty{0};
+
+    /*
+      Locking, for server sessions (see Server). The console and batch
+      paths run on one thread and never contend.
+        tables          shared while working on existing records; exclusive
+                        to add or remove products or customers, to edit
+                        product text, and to rewrite snapshots
+        invoice_locks   one stripe per invoice number, held for a whole
+                        dispatch so its ordered-vs-dispatched check holds
+        history_lock    invoices, dispatches and their indexes
+        consignment_lock
+      Taken in that order; the journal's own mutex comes last. Stock
+      quantities take no lock at all (see Stock Reservation).
+    */
+    static constexpr size_t STRIPES = 64;
+    shared_mutex tables;
+    array<mutex,STRIPES> invoice_locks;
+    mutex history_lock, consignment_lock;
+
+    mutex& invoice_lock(const string &num){ return invoice_locks[hash<string>()(num) % STRIPES]; }
+
+    explicit App(const Options &opt = Options()){
+        fm.binary = opt.binary;
+        fm.threads = opt.threads;
+        fm.lenient = opt.lenient;
+        fm.journaled = opt.journal;
+        recent_months = opt.recent_months;
+        fm.journal.window = chrono::microseconds(opt.commit_window_us);
+        load_all();
+    }
+
+    void load_all(){
+        // The files are independent, so they load concurrently.
+        auto fp = async(launch::async, [this]{ return fm.load_products(); });
+        auto fc = async(launch::async, [this]{ return fm.load_customers(); });
+        string from = first_recent_month(recent_months);
+        auto fh = async(launch::async, [this, from]{ return fm.load_history(from); });
+        consignment.load(fm.load_consignment());
+        products = fp.get();
+        customers = fc.get();
+        auto h = fh.get();
+        invoices = move(h.invoices);
+        dispatches = move(h.dispatches);
+        history_months = move(h.months);
+        loaded_months = move(h.loaded);
+        invoice_ranges = move(h.invoice_ranges);
+        dispatch_ranges = move(h.dispatch_ranges);
+        legacy_history = h.legacy;
+        tie(admin_user, admin_pass) = fm.load_admin();
+        reindex();
+
+        // Months seen in the records are in memory by definition; an
+        // unpartitioned file is written out as segments on the next save.
+        for(auto *by_month: {&invoice_months, &dispatch_months})
+            for(auto &kv: *by_month){
+                history_months.insert(kv.first);
+                loaded_months.insert(kv.first);
+            }
+        if(legacy_history) dirty_months = loaded_months;
+
+        fm.journal.path = fm.journal_file;
+        replay_journal();
+        if(fm.journaled) fm.journal.open();
+        else if(fm.journal.records){ save_snapshots(); fm.journal.reset(); fm.journal.close(); }
+
+        // Counters never go below what the data already contains, so an
+        // old data set without counters.txt continues its numbering.
+        fm.sequences.path = fm.counters_file;
+        long long maxn = 0;
+        for(auto &i: invoices) maxn = max(maxn, number_value(i.number));
+        for(auto &kv: invoice_ranges) maxn = max(maxn, kv.second.hi);
+        fm.sequences.observe("invoice", maxn);
+        maxn = 0;
+        for(auto &d: dispatches) maxn = max(maxn, number_value(d.number));
+        for(auto &kv: dispatch_ranges) maxn = max(maxn, kv.second.hi);
+        fm.sequences.observe("dispatch", maxn);
+    }
+
+    // The files are written concurrently and each is replaced atomically.
+    // A crash part-way leaves some new and some old, and the journal,
+    // reset only after all of them, brings the old ones forward on replay.
+    void save_snapshots(){
+        compact_tables();
+        auto fp = async(launch::async, [this]{ fm.save_products(products); });
+        auto fc = async(launch::async, [this]{ fm.save_customers(customers); });
+        auto fk = async(launch::async, [this]{ fm.save_consignment(consignment.rows()); });
+        save_history();
+        fp.get();
+        fc.get();
+        fk.get();
+        dirty = 0;
+    }
+
+    void save_all(){
+        save_snapshots();
+        if(fm.journaled) fm.journal.reset();
+    }
 
-    string admin_user, admin_pass;
+    // Folds the journal into the snapshots. If a write fails the journal
+    // is left as it was, so nothing is lost and the next commit retries.
+    void compact(){
+        try{ save_all(); }
+        catch(const exception &e){ cerr << "Compaction failed: " << e.what() << "\n"; }
+    }
 
-    App(){
-        load_all();
+    /* ---------- Persistence ---------- */
+
+    // Each mutation reports what it changed through one of the log_* calls
+    // and the action finishes with commit(), which makes it durable.
+
+    void log_product(const Product &p){
+        if(fm.journaled) fm.journal.append_with('P', [&]{ return p.to_line(stock_of(p)); });
+        else dirty |= D_PRODUCTS;
     }
 
-    void load_all(){
-        products = fm.load_products();
-        customers = fm.load_customers();
-        invoices = fm.load_invoices();
-        dispatches = fm.load_dispatches();
-        consignment = fm.load_consignment();
-        tie(admin_user, admin_pass) = fm.load_admin();
+    void log_product_delete(const string &code){
+        if(fm.journaled) fm.journal.append('X', code);
+        else dirty |= D_PRODUCTS;
     }
 
-    void save_all(){
-        fm.save_products(products);
-        fm.save_customers(customers);
-        fm.save_invoices(invoices);
-        fm.save_dispatches(dispatches);
-        fm.save_consignment(consignment);
+    void log_customer(const Customer &c){
+        if(fm.journaled) fm.journal.append('C', c.to_line());
+        else dirty |= D_CUSTOMERS;
+    }
+
+    void log_customer_delete(const string &code){
+        if(fm.journaled) fm.journal.append('Y', code);
+        else dirty |= D_CUSTOMERS;
+    }
+
+    void log_invoice(const Invoice &inv){
+        if(fm.journaled) fm.journal.append('I', inv.to_block());
+        else dirty |= D_INVOICES;
+    }
+
+    void log_dispatch(const Dispatch &d){
+        if(fm.journaled) fm.journal.append('D', d.to_block());
+        else dirty |= D_DISPATCHES;
+    }
+
+    void log_consignment(const string &cc, const string &pc, long long qty){
+        if(fm.journaled) fm.journal.append('K', cc + "," + pc + "," + to_string(qty));
+        else dirty |= D_CONSIGNMENT;
+    }
+
+    // Returns an error message when the changes may not be on disk, or ""
+    // once they are. They stay in memory either way; a later save_all()
+    // (Save & Exit, server shutdown) writes them out if it can.
+    string commit(){
+        try{
+            if(fm.journaled){
+                fm.journal.sync();
+                if(fm.journal.records >= fm.compact_after) compact();
+                return "";
+            }
+            if(dirty & (D_PRODUCTS | D_CUSTOMERS)) compact_tables();
+            if(dirty & D_PRODUCTS) fm.save_products(products);
+            if(dirty & D_CUSTOMERS) fm.save_customers(customers);
+            if(dirty & (D_INVOICES | D_DISPATCHES)) save_history();
+            if(dirty & D_CONSIGNMENT) fm.save_consignment(consignment.rows());
+            dirty = 0;
+        }
+        catch(const exception &e){ return string("Not saved: ") + e.what(); }
+        return "";
+    }
+
+    // commit() for server sessions, called without table locks: the
+    // journal flush runs alongside other sessions, while compaction and
+    // snapshot rewrites wait for the tables to themselves.
+    string commit_shared(){
+        if(fm.journaled){
+            try{ fm.journal.sync(); }
+            catch(const exception &e){ return string("Not saved: ") + e.what(); }
+            if(fm.journal.records < fm.compact_after) return "";
+        }
+        unique_lock<shared_mutex> lk(tables);
+        return commit();
+    }
+
+    // commit() for the console screens; prints why the change was not
+    // saved, if it was not.
+    bool committed(){
+        string err = commit();
+        if(!err.empty()) cout << err << "\n";
+        return err.empty();
+    }
+
+    // Re-applies journal records on top of the loaded snapshots. Appends are
+    // skipped when the number already exists in the record's month, so a
+    // crash between writing the snapshots and resetting the journal does
+    // not duplicate history. Records that do not parse are handled like
+    // bad snapshot lines.
+    void replay_journal(){
+        auto recs = fm.journal.read_all();
+        if(recs.empty()) return;
+
+        size_t n = 0;
+        vector<string_view> fields;
+        auto skip = [&](const string &why){
+            string msg = fm.journal.path + ": record " + to_string(n) + ": " + why;
+            if(!fm.lenient) throw runtime_error(msg + " (--lenient skips bad lines)");
+            cerr << msg + ", record skipped\n";
+        };
+        for(auto &r: recs){
+            const string &body = r.second;
+            string why;
+            n++;
+            switch(r.first){
+            case 'P': {
+                Product p;
+                why = Product::from_line(body, p);
+                if(!why.empty()){ skip(why); break; }
+                Product* cur = find_product(p.code);
+                if(cur){
+                    *cur = p;
+                    columns.update(slot_of(*cur), p);
+                    product_search.set(columns.code_id[slot_of(*cur)], search_text(p));
+                }
+                else insert_product(p);
+                break;
+            }
+            case 'X':
+                erase_product(body);
+                break;
+            case 'C': {
+                Customer c;
+                why = Customer::from_line(body, c);
+                if(!why.empty()){ skip(why); break; }
+                Customer* cur = find_customer(c.code);
+                if(cur){
+                    *cur = c;
+                    customer_search.set(codes.intern(c.code), search_text(c));
+                    customer_by_name.mark(cur - customers.data());
+                }
+                else insert_customer(c);
+                break;
+            }
+            case 'Y':
+                erase_customer(body);
+                break;
+            // The record's month is read in before its items are parsed,
+            // so a record already saved is skipped without taking room in
+            // item_arena.
+            case 'I': {
+                split_view(body, ',', fields);
+                if(fields.size()>=5){
+                    ensure_month(month_of(fields[2]));
+                    if(loaded_invoice(string(fields[0]))) break;
+                }
+                Invoice inv;
+                why = Invoice::from_fields(fields, inv);
+                if(!why.empty()){ skip(why); break; }
+                add_invoice(inv);
+                break;
+            }
+            case 'D': {
+                split_view(body, ',', fields);
+                if(fields.size()>=4){
+                    ensure_month(month_of(fields[2]));
+                    if(loaded_dispatch(string(fields[0]))) break;
+                }
+                Dispatch d;
+                why = Dispatch::from_fields(fields, d);
+                if(!why.empty()){ skip(why); break; }
+                add_dispatch(d);
+                break;
+            }
+            case 'K': {
+                auto parts = split(body, ',');
+                long long qty;
+                if(parts.size()<3){ skip("expected 3 fields, found " + to_string(parts.size())); break; }
+                if(!parse_qty(parts[2], qty)){ skip("qty is not a whole number"); break; }
+                consignment.set(codes.intern(parts[0]), codes.intern(parts[1]), qty);
+                break;
+            }
+            }
+        }
     }
 
     Product* find_product(const string &code){
-        for(auto &p: products) if(p.code==code) return &p;
-        return nullptr;
+        LatencyTimer t(M_FIND_PRODUCT);
+        size_t i = product_index.find(code);
+        return i==product_index.EMPTY ? nullptr : &products[i];
+    }
+
+    Product* find_product(uint32_t id){
+        size_t i = id<product_slot.size() ? product_slot[id] : NO_SLOT;
+        return i==NO_SLOT ? nullptr : &products[i];
     }
 
     Customer* find_customer(const string &code){
-        for(auto &c: customers) if(c.code==code) return &c;
-        return nullptr;
+        LatencyTimer t(M_FIND_CUSTOMER);
+        size_t i = customer_index.find(code);
+        return i==customer_index.EMPTY ? nullptr : &customers[i];
     }
 
+    // History lookups fall back to reading older months, newest first,
+    // that can hold the number, until it turns up; a number in none of
+    // them reads nothing. Loading moves the vectors, so the pointer is
+    // only good until the next history access.
     Invoice* find_invoice(const string &num){
-        for(auto &i: invoices) if(i.number==num) return &i;
-        return nullptr;
+        LatencyTimer t(M_FIND_INVOICE);
+        Invoice* inv = loaded_invoice(num);
+        long long v = inv ? 0 : number_value(num);
+        for(auto it = history_months.rbegin(); !inv && it!=history_months.rend(); ++it)
+            if(unloaded_holding(*it, invoice_ranges, v)){ ensure_month(*it); inv = loaded_invoice(num); }
+        return inv;
     }
 
     Dispatch* find_dispatch(const string &num){
-        for(auto &d: dispatches) if(d.number==num) return &d;
-        return nullptr;
+        LatencyTimer t(M_FIND_DISPATCH);
+        Dispatch* d = loaded_dispatch(num);
+        long long v = d ? 0 : number_value(num);
+        for(auto it = history_months.rbegin(); !d && it!=history_months.rend(); ++it)
+            if(unloaded_holding(*it, dispatch_ranges, v)){ ensure_month(*it); d = loaded_dispatch(num); }
+        return d;
+    }
+
+    bool unloaded_holding(const string &m, const FileManager::MonthRanges &ranges, long long v) const {
+        auto r = ranges.find(m);
+        return (r==ranges.end() || r->second.may_hold(v)) && !loaded_months.count(m);
+    }
+
+    Invoice* loaded_invoice(const string &num){
+        size_t i = invoice_index.find(num);
+        return i==invoice_index.EMPTY ? nullptr : &invoices[i];
+    }
+
+    Dispatch* loaded_dispatch(const string &num){
+        size_t i = dispatch_index.find(num);
+        return i==dispatch_index.EMPTY ? nullptr : &dispatches[i];
+    }
+
+    /* ---------- Record Storage ---------- */
+
+    // All inserts and deletes go through these so the code indexes stay in
+    // sync with the vectors.
+
+    void reindex(){
+        free_products.clear();
+        free_customers.clear();
+        product_index.rebuild(products);
+        columns.build(products, free_products);
+        index_product_ids();
+        customer_index.rebuild(customers);
+        customer_by_code.reset(customers.size());
+        customer_by_name.reset(customers.size());
+        invoice_index.rebuild(invoices);
+        dispatch_index.rebuild(dispatches);
+
+        dispatched_index.clear();
+        for(auto &d: dispatches) index_dispatched(d);
+
+        invoice_months.clear();
+        dispatch_months.clear();
+        for(size_t i=0;i<invoices.size();++i) invoice_months[month_of(invoices[i].date)].push_back(i);
+        for(size_t i=0;i<dispatches.size();++i) dispatch_months[month_of(dispatches[i].date)].push_back(i);
+    }
+
+    void index_dispatched(const Dispatch &d){
+        auto &agg = dispatched_index[d.invoice_number];
+        for(auto &it: d.items) agg[it.product] += it.qty;
+    }
+
+    void index_product_ids(){
+        product_slot.assign(codes.size(), NO_SLOT);
+        for(size_t i=0;i<products.size();++i)
+            if(product_live(i)) index_product_id(i);
+    }
+
+    // First product with a code wins, like find_product(string).
+    void index_product_id(size_t slot){
+        uint32_t id = columns.code_id[slot];
+        if(id>=product_slot.size()) product_slot.resize(max<size_t>(id+1, codes.size()), NO_SLOT);
+        if(product_slot[id]==NO_SLOT) product_slot[id] = slot;
+    }
+
+    Product& insert_product(const Product &p){
+        size_t i;
+        if(!free_products.empty()){
+            i = free_products.take();
+            products[i] = p;
+            columns.assign(i, p);
+        } else {
+            i = products.size();
+            products.push_back(p);
+            columns.push(p);
+        }
+        product_index.insert(i);
+        index_product_id(i);
+        product_search.set(columns.code_id[i], search_text(p));
+        return products[i];
+    }
+
+    size_t product_count() const { return products.size() - free_products.size(); }
+
+    bool product_live(size_t slot) const { return !free_products.has(slot); }
+    bool customer_live(size_t slot) const { return !free_customers.has(slot); }
+
+    // Room for n more products or customers ahead of a bulk insert.
+    void reserve_products(size_t n){
+        codes.reserve(n);
+        products.reserve(products.size()+n);
+        product_index.reserve(products.size()+n);
+        columns.reserve(products.size()+n);
+    }
+
+    void reserve_customers(size_t n){
+        codes.reserve(n);
+        customers.reserve(customers.size()+n);
+        customer_index.reserve(customers.size()+n);
+    }
+
+    size_t slot_of(const Product &p) const { return &p - products.data(); }
+
+    // Every change to an existing product goes through these two so the
+    // column mirror follows, and the change is logged for commit().
+    void product_changed(Product &p){
+        columns.update(slot_of(p), p);
+        if(columns.needs_compaction()) columns.build(products, free_products);
+        product_search.set(columns.code_id[slot_of(p)], search_text(p));
+        log_product(p);
+    }
+
+    Customer& insert_customer(const Customer &c){
+        size_t i;
+        if(!free_customers.empty()){
+            i = free_customers.take();
+            customers[i] = c;
+            customer_by_code.revive(i);
+            customer_by_name.revive(i);
+        } else {
+            i = customers.size();
+            customers.push_back(c);
+            customer_by_code.push();
+            customer_by_name.push();
+        }
+        customer_index.insert(i);
+        customer_search.set(codes.intern(c.code), search_text(c));
+        return customers[i];
+    }
+
+    void customer_changed(Customer &c){
+        customer_search.set(codes.intern(c.code), search_text(c));
+        customer_by_name.mark(&c - customers.data());
+        log_customer(c);
+    }
+
+    Invoice& insert_invoice(const Invoice &inv){
+        invoices.push_back(inv);
+        invoice_index.insert(invoices.size()-1);
+        invoice_months[month_of(inv.date)].push_back(invoices.size()-1);
+        return invoices.back();
+    }
+
+    Dispatch& insert_dispatch(const Dispatch &d){
+        dispatches.push_back(d);
+        dispatch_index.insert(dispatches.size()-1);
+        dispatch_months[month_of(d.date)].push_back(dispatches.size()-1);
+        index_dispatched(d);
+        return dispatches.back();
+    }
+
+    // New history records. Their month is read in first, so saving it
+    // later keeps what was already on disk.
+    Invoice& add_invoice(const Invoice &inv){
+        string m = month_of(inv.date);
+        ensure_month(m);
+        dirty_months.insert(m);
+        return insert_invoice(inv);
+    }
+
+    Dispatch& add_dispatch(const Dispatch &d){
+        string m = month_of(d.date);
+        ensure_month(m);
+        dirty_months.insert(m);
+        return insert_dispatch(d);
+    }
+
+    // Deleting leaves a tombstone: the record is cleared, dropped from the
+    // indexes and its slot kept for the next insert, so other records stay
+    // where they are and pointers to them stay good.
+    bool erase_product(const string &code){
+        size_t i = product_index.find(code);
+        if(i==product_index.EMPTY) return false;
+        uint32_t id = columns.code_id[i];
+        product_index.erase(code);
+        product_search.remove(id);
+        product_slot[id] = NO_SLOT;
+        columns.kill(i);
+        products[i] = Product();
+        free_products.add(i);
+        if(free_products.size()*TOMBSTONE_RATIO > products.size()) compact_products();
+        return true;
+    }
+
+    bool erase_customer(const string &code){
+        size_t i = customer_index.find(code);
+        if(i==customer_index.EMPTY) return false;
+        customer_index.erase(code);
+        uint32_t id;
+        if(codes.find(code, id)) customer_search.remove(id);
+        customer_by_code.drop(i);
+        customer_by_name.drop(i);
+        customers[i] = Customer();
+        free_customers.add(i);
+        if(free_customers.size()*TOMBSTONE_RATIO > customers.size()) compact_customers();
+        return true;
+    }
+
+    // Slot renumbering for compaction: survivors move down in order and
+    // to[i] is the new slot of i, or NO_SLOT for a tombstone.
+    template<class T>
+    static vector<size_t> close_gaps(vector<T> &v, const FreeSlots &gone){
+        vector<size_t> to(v.size(), NO_SLOT);
+        size_t n = 0;
+        for(size_t i=0;i<v.size();++i){
+            if(gone.has(i)) continue;
+            to[i] = n;
+            if(n!=i) v[n] = move(v[i]);
+            n++;
+        }
+        v.resize(n);
+        return to;
+    }
+
+    // Survivors keep their order, so every index is renumbered in one pass
+    // instead of being rebuilt.
+    void compact_products(){
+        if(free_products.empty()) return;
+        auto to = close_gaps(products, free_products);
+        free_products.clear();
+        product_index.remap(to);
+        columns.compact(to, products.size());
+        for(auto &s: product_slot) if(s!=NO_SLOT) s = to[s];
+    }
+
+    void compact_customers(){
+        if(free_customers.empty()) return;
+        auto to = close_gaps(customers, free_customers);
+        free_customers.clear();
+        customer_index.remap(to);
+        customer_by_code.remap(to, customers.size());
+        customer_by_name.remap(to, customers.size());
+    }
+
+    // Snapshots are written without tombstones.
+    void compact_tables(){
+        compact_products();
+        compact_customers();
+    }
+
+    /* ---------- History Partitions ---------- */
+
+    // Server sessions call these with history_lock held.
+
+    // First month of the window read at startup, or "" for everything.
+    static string first_recent_month(unsigned months){
+        if(!months) return "";
+        string t = today_str();
+        int y = atoi(t.substr(0,4).c_str()), m = atoi(t.substr(5,2).c_str()) - (int)(months-1);
+        while(m<1){ m += 12; y--; }
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%04d-%02d", y, m);
+        return buf;
+    }
+
+    void ensure_month(const string &m){
+        if(!loaded_months.insert(m).second || !history_months.count(m)) return;
+        LatencyTimer t(M_LOAD_MONTH);
+        set<string> one{m};
+        for(auto &inv: fm.read_segments<Invoice>(fm.invoices_file, one)) insert_invoice(inv);
+        for(auto &d: fm.read_segments<Dispatch>(fm.dispatches_file, one)) insert_dispatch(d);
+    }
+
+    // Every month from m on: an invoice's dispatches are never dated
+    // before it, so this brings in all of them.
+    void ensure_from(const string &m){
+        for(auto it = history_months.lower_bound(m); it!=history_months.end(); ++it)
+            ensure_month(*it);
+    }
+
+    template<class T>
+    static vector<T> records_in(const vector<T> &all, const map<string, vector<size_t>> &by_month, const string &m){
+        vector<T> out;
+        auto it = by_month.find(m);
+        if(it!=by_month.end())
+            for(size_t i: it->second) out.push_back(all[i]);
+        return out;
+    }
+
+    // Months in memory get their ranges from the records whenever they
+    // change or have none yet; the others keep what was read at startup.
+    void save_ranges(){
+        bool changed = false;
+        for(auto &m: loaded_months){
+            if(!dirty_months.count(m) && invoice_ranges.count(m) && dispatch_ranges.count(m)) continue;
+            FileManager::NumberRange ri, rd;
+            auto it = invoice_months.find(m);
+            if(it!=invoice_months.end()) for(size_t i: it->second) ri.add(invoices[i].number);
+            auto dt = dispatch_months.find(m);
+            if(dt!=dispatch_months.end()) for(size_t i: dt->second) rd.add(dispatches[i].number);
+            invoice_ranges[m] = ri;
+            dispatch_ranges[m] = rd;
+            changed = true;
+        }
+        if(changed) fm.save_ranges(invoice_ranges, dispatch_ranges);
+    }
+
+    void save_history(){
+        save_ranges();
+        for(auto &m: dirty_months){
+            fm.save_segment(fm.invoices_file, m, records_in(invoices, invoice_months, m));
+            fm.save_segment(fm.dispatches_file, m, records_in(dispatches, dispatch_months, m));
+        }
+        dirty_months.clear();
+        if(legacy_history){ fm.remove_legacy_history(); legacy_history = false; }
+    }
+
+    /* ---------- Stock Reservation ---------- */
+
+    /*
+      Product quantities are updated with atomic read-modify-write, so
+      sessions selling different products, or the same one, never wait on
+      each other. take_stock() is a compare-and-swap loop that refuses to
+      go below zero; reserve_stock() takes a whole dispatch that way and
+      gives back what it took if any line fails. The column mirror gets
+      the same deltas. Quantities are only assigned outright (edits,
+      replay) while the tables are held exclusively.
+    */
+
+    static long long stock_of(const Product &p){
+        return shared_ref(p.qty).load(memory_order_acquire);
+    }
+
+    void adjust_stock(Product &p, long long delta){
+        shared_ref(p.qty).fetch_add(delta, memory_order_acq_rel);
+        columns.add_qty(slot_of(p), delta);
+        log_product(p);
+    }
+
+    // Takes qty out of p's stock unless that would leave it negative.
+    // Not logged; the caller logs once the whole operation stands.
+    bool take_stock(Product &p, long long qty){
+        long long cur = stock_of(p);
+        do {
+            if(cur < qty) return false;
+        } while(!shared_ref(p.qty).compare_exchange_weak(cur, cur-qty,
+                                                         memory_order_acq_rel, memory_order_acquire));
+        columns.add_qty(slot_of(p), -qty);
+        return true;
+    }
+
+    // Takes every line of items out of stock, or none of them. Returns an
+    // error message, or "" on success, in which case the products are
+    // logged.
+    string reserve_stock(const ItemSpan &items){
+        size_t taken = 0;
+        string err;
+        for(; taken<items.size(); ++taken){
+            auto &it = items[taken];
+            Product* p = find_product(it.product);
+            if(!p){ err = "Product not found."; break; }
+            if(!take_stock(*p, it.qty)){ err = "Not enough stock."; break; }
+        }
+        if(err.empty()){
+            for(auto &it: items) log_product(*find_product(it.product));
+            return "";
+        }
+        // Another session may have logged a value that included our share,
+        // so the give-back is logged too.
+        for(size_t i=0;i<taken;++i)
+            adjust_stock(*find_product(items[i].product), items[i].qty);
+        return items[taken].product_code() + ": " + err;
     }
 
     /* ---------- Login ---------- */
@@ -472,11 +3735,88 @@ struct App {
             else if(s=="5") consignment_menu();
             else if(s=="6") inventory_report();
             else if(s=="7") change_admin_password();
-            else if(s=="8"){ save_all(); break; }
+            else if(s=="8"){
+                try{ save_all(); }
+                catch(const exception &e){
+                    cout << "Save failed: " << e.what() << ". Changes are kept in " << fm.journal_file << ".\n";
+                }
+                break;
+            }
             else { cout << "Invalid choice.\n"; wait_key(); }
         }
     }
 
+    /* ---------- Search ---------- */
+
+    static string search_text(const Product &p){ return p.name + "\n" + p.description; }
+    static string search_text(const Customer &c){ return c.name + "\n" + c.phone + "\n" + c.address; }
+
+    // Products whose name or description holds every word of q, at most
+    // limit. Server sessions call this with the tables shared.
+    vector<const Product*> search_products(string_view q, size_t limit){
+        product_search.ensure_built([&](auto add){
+            for(size_t i=0;i<products.size();++i)
+                if(product_live(i)) add(columns.code_id[i], search_text(products[i]));
+        });
+        vector<const Product*> out;
+        for(uint32_t id: product_search.search(q, limit))
+            if(const Product* p = find_product(id)) out.push_back(p);
+        return out;
+    }
+
+    // Customers whose name, phone or address holds every word of q, at
+    // most limit.
+    vector<const Customer*> search_customers(string_view q, size_t limit){
+        customer_search.ensure_built([&](auto add){
+            for(size_t i=0;i<customers.size();++i)
+                if(customer_live(i)) add(codes.intern(customers[i].code), search_text(customers[i]));
+        });
+        vector<const Customer*> out;
+        for(uint32_t id: customer_search.search(q, limit))
+            if(const Customer* c = find_customer(codes.str(id))) out.push_back(c);
+        return out;
+    }
+
+    static constexpr size_t SEARCH_SHOWN = 50;
+
+    void search_products_screen(){
+        cout << "Search name/description: ";
+        string q; getline(cin,q);
+        auto found = search_products(q, SEARCH_SHOWN+1);
+
+        cout << "Code       Name                 Qty       Description\n";
+        cout << "---------------------------------------------------------------\n";
+        for(size_t i=0;i<found.size() && i<SEARCH_SHOWN;++i){
+            const Product &p = *found[i];
+            cout << left << setw(10) << p.code
+                 << setw(20) << p.name
+                 << setw(10) << stock_of(p)
+                 << p.description << "\n";
+        }
+        if(found.empty()) cout << "No matches.\n";
+        else if(found.size()>SEARCH_SHOWN) cout << "(first " << SEARCH_SHOWN << " matches shown)\n";
+        wait_key();
+    }
+
+    void search_customers_screen(){
+        cout << "Search name/phone/address: ";
+        string q; getline(cin,q);
+        auto found = search_customers(q, SEARCH_SHOWN+1);
+
+        cout << "Code       Name                Phone         Address\n";
+        cout << "--------------------------------------------------------------\n";
+        for(size_t i=0;i<found.size() && i<SEARCH_SHOWN;++i){
+            const Customer &c = *found[i];
+            cout << left << setw(10) << c.code
+                 << setw(20) << c.name
+                 << setw(13) << c.phone
+                 << c.address << "\n";
+        }
+        if(found.empty()) cout << "No matches.\n";
+        else if(found.size()>SEARCH_SHOWN) cout << "(first " << SEARCH_SHOWN << " matches shown)\n";
+        wait_key();
+    }
+
     /* ---------- Product Management ---------- */
 
     void manage_products(){
@@ -487,7 +3827,10 @@ struct App {
             cout << "2) Edit Product\n";
             cout << "3) Delete Product\n";
             cout << "4) List Products\n";
-            cout << "5) Back\n";
+            cout << "5) Low Stock Report\n";
+            cout << "6) Sales by Product (date range)\n";
+            cout << "7) Search Products\n";
+            cout << "8) Back\n";
             cout << "Select: ";
 
             string s; getline(cin,s);
@@ -496,7 +3839,10 @@ struct App {
             else if(s=="2") edit_product();
             else if(s=="3") delete_product();
             else if(s=="4") list_products();
-            else if(s=="5") return;
+            else if(s=="5") low_stock_report();
+            else if(s=="6") sales_report();
+            else if(s=="7") search_products_screen();
+            else if(s=="8") return;
             else { cout << "Invalid.\n"; wait_key(); }
         }
     }
@@ -506,6 +3852,11 @@ struct App {
         cout << "Product code: ";
         getline(cin,p.code);
 
+        if(p.code.empty()){
+            cout << "Code cannot be empty.\n";
+            wait_key();
+            return;
+        }
         if(find_product(p.code)){
             cout << "Code already exists.\n";
             wait_key();
@@ -518,14 +3869,20 @@ struct App {
         cout << "Description: ";
         getline(cin,p.description);
 
-        cout << "Initial quantity: ";
-        string q; getline(cin,q);
-        p.qty = stoll(q);
+        if(!p.plain()){
+            cout << "Text must not contain control characters.\n"; wait_key(); return;
+        }
 
-        products.push_back(p);
-        fm.save_products(products);
+        while(true){
+            cout << "Initial quantity: ";
+            string q; getline(cin,q);
+            if(parse_qty(q, p.qty)) break;
+            cout << "Invalid quantity.\n";
+        }
 
-        cout << "Product added.\n";
+        insert_product(p);
+        log_product(p);
+        if(committed()) cout << "Product added.\n";
         wait_key();
     }
 
@@ -538,20 +3895,30 @@ struct App {
             cout << "Not found.\n"; wait_key(); return;
         }
 
+        Product text = *p;
         cout << "New name (" << p->name << "): ";
         string s; getline(cin,s);
-        if(!s.empty()) p->name = s;
+        if(!s.empty()) text.name = s;
 
         cout << "New description (" << p->description << "): ";
         getline(cin,s);
-        if(!s.empty()) p->description = s;
+        if(!s.empty()) text.description = s;
 
-        cout << "New quantity (" << p->qty << "): ";
-        getline(cin,s);
-        if(!s.empty()) p->qty = stoll(s);
+        if(!text.plain()){
+            cout << "Text must not contain control characters.\n"; wait_key(); return;
+        }
+        p->name = text.name;
+        p->description = text.description;
 
-        fm.save_products(products);
-        cout << "Saved.\n";
+        while(true){
+            cout << "New quantity (" << p->qty << "): ";
+            getline(cin,s);
+            if(s.empty() || parse_qty(s, p->qty)) break;
+            cout << "Invalid quantity.\n";
+        }
+
+        product_changed(*p);
+        if(committed()) cout << "Saved.\n";
         wait_key();
     }
 
@@ -559,28 +3926,71 @@ struct App {
         cout << "Product code: ";
         string code; getline(cin,code);
 
-        auto it = remove_if(products.begin(), products.end(), [&](const Product &p){ return p.code==code; });
-
-        if(it!=products.end()){
-            products.erase(it, products.end());
-            fm.save_products(products);
-            cout << "Deleted.\n";
+        if(erase_product(code)){
+            log_product_delete(code);
+            if(committed()) cout << "Deleted.\n";
         } else {
             cout << "Not found.\n";
         }
         wait_key();
     }
 
+    using TextCursor = OrderedIndex<string>::Entry;
+    using QtyCursor = OrderedIndex<long long>::Entry;
+
+    string product_row(size_t slot) const {
+        string r;
+        columns.format_row(slot, r);
+        return r;
+    }
+
     void list_products(){
-        cout << "Code       Name                 Qty       Description\n";
-        cout << "---------------------------------------------------------------\n";
-        for(auto &p: products){
-            cout << left << setw(10) << p.code
-                 << setw(20) << p.name
-                 << setw(10) << p.qty
-                 << p.description << "\n";
+        cout << "Order by (1=as entered, 2=code, 3=name, 4=stock): ";
+        string s; getline(cin,s);
+        const char* header = "Code       Name                 Qty       Description\n"
+                             "---------------------------------------------------------------\n";
+        auto row = [&](auto &e){ return product_row(e.second); };
+        if(s=="2")
+            show_cursor_pages(header, [&](const TextCursor* after, size_t n){ return columns.page_by_code(after, n); }, row);
+        else if(s=="3")
+            show_cursor_pages(header, [&](const TextCursor* after, size_t n){ return columns.page_by_name(after, n); }, row);
+        else if(s=="4")
+            show_cursor_pages(header, [&](const QtyCursor* after, size_t n){ return columns.page_by_qty(after, n); }, row);
+        else show_product_rows(header);
+    }
+
+    // The cached report rows in slot order, a page at a time. Deleted
+    // slots have an empty row and are left out of the pages.
+    void show_product_rows(const char* header){
+        auto &rows = columns.report_rows();
+        if(free_products.empty()){
+            show_pages(header, rows.size(), [&](size_t i) -> const string& { return rows[i]; });
+            return;
         }
-        wait_key();
+        vector<uint32_t> live;
+        for(size_t i=0;i<rows.size();++i) if(product_live(i)) live.push_back(i);
+        show_pages(header, live.size(), [&](size_t i) -> const string& { return rows[live[i]]; });
+    }
+
+    // Lowest stock first, read off the qty ordering until limit is reached.
+    void low_stock_report(){
+        cout << "Show products with quantity below: ";
+        string s; getline(cin,s);
+        long long limit = 10;
+        if(!s.empty() && !parse_qty(s, limit)){
+            cout << "Invalid quantity.\n"; wait_key(); return;
+        }
+
+        cout << "Products: " << product_count()
+             << "   Units in stock: " << columns.total_stock() << "\n\n";
+        show_cursor_pages("Code       Name                 Qty       Description\n"
+                          "---------------------------------------------------------------\n",
+                          [&](const QtyCursor* after, size_t n){
+                              auto got = columns.page_by_qty(after, n);
+                              while(!got.empty() && got.back().first>=limit) got.pop_back();
+                              return got;
+                          },
+                          [&](auto &e){ return product_row(e.second); });
     }
 
     /* ---------- Customer Management ---------- */
@@ -593,7 +4003,8 @@ struct App {
             cout << "2) Edit Customer\n";
             cout << "3) Delete Customer\n";
             cout << "4) List Customers\n";
-            cout << "5) Back\n";
+            cout << "5) Search Customers\n";
+            cout << "6) Back\n";
 
             string s; getline(cin,s);
 
@@ -601,7 +4012,8 @@ struct App {
             else if(s=="2") edit_customer();
             else if(s=="3") delete_customer();
             else if(s=="4") list_customers();
-            else if(s=="5") return;
+            else if(s=="5") search_customers_screen();
+            else if(s=="6") return;
             else { cout << "Invalid.\n"; wait_key(); }
         }
     }
@@ -612,6 +4024,9 @@ struct App {
         cout << "Customer code: ";
         getline(cin,c.code);
 
+        if(c.code.empty()){
+            cout << "Code cannot be empty.\n"; wait_key(); return;
+        }
         if(find_customer(c.code)){
             cout << "Code exists.\n"; wait_key(); return;
         }
@@ -625,10 +4040,13 @@ struct App {
         cout << "Address: ";
         getline(cin,c.address);
 
-        customers.push_back(c);
-        fm.save_customers(customers);
+        if(!c.plain()){
+            cout << "Text must not contain control characters.\n"; wait_key(); return;
+        }
 
-        cout << "Customer added.\n";
+        insert_customer(c);
+        log_customer(c);
+        if(committed()) cout << "Customer added.\n";
         wait_key();
     }
 
@@ -639,18 +4057,24 @@ struct App {
         Customer* c = find_customer(code);
         if(!c){ cout << "Not found.\n"; wait_key(); return;}
 
+        Customer text = *c;
         string s;
         cout << "New name ("<<c->name<<"): ";
-        getline(cin,s); if(!s.empty()) c->name = s;
+        getline(cin,s); if(!s.empty()) text.name = s;
 
         cout << "New phone ("<<c->phone<<"): ";
-        getline(cin,s); if(!s.empty()) c->phone = s;
+        getline(cin,s); if(!s.empty()) text.phone = s;
 
         cout << "New address ("<<c->address<<"): ";
-        getline(cin,s); if(!s.empty()) c->address = s;
+        getline(cin,s); if(!s.empty()) text.address = s;
 
-        fm.save_customers(customers);
-        cout << "Saved.\n";
+        if(!text.plain()){
+            cout << "Text must not contain control characters.\n"; wait_key(); return;
+        }
+        *c = text;
+
+        customer_changed(*c);
+        if(committed()) cout << "Saved.\n";
         wait_key();
     }
 
@@ -658,46 +4082,125 @@ struct App {
         cout << "Customer code: ";
         string code; getline(cin,code);
 
-        auto it = remove_if(customers.begin(), customers.end(), [&](const Customer &c){ return c.code==code; });
-
-        if(it!=customers.end()){
-            customers.erase(it, customers.end());
-            fm.save_customers(customers);
-            cout << "Deleted.\n";
+        if(erase_customer(code)){
+            log_customer_delete(code);
+            if(committed()) cout << "Deleted.\n";
         } else cout<<"Not found.\n";
 
         wait_key();
     }
 
+    // Customers a page at a time by code or name; see OrderedIndex::page().
+    vector<TextCursor> customer_page(bool by_name, const TextCursor* after, size_t n){
+        if(by_name) return customer_by_name.page([&](size_t i){ return customers[i].name; }, after, n);
+        return customer_by_code.page([&](size_t i){ return customers[i].code; }, after, n);
+    }
+
+    static string customer_row(const Customer &c){
+        string r;
+        put_field(r, c.code, 10);
+        put_field(r, c.name, 20);
+        put_field(r, c.phone, 13);
+        r += c.address;
+        r += '\n';
+        return r;
+    }
+
     void list_customers(){
-        cout << "Code       Name                Phone         Address\n";
-        cout << "--------------------------------------------------------------\n";
-        for(auto &c: customers){
-            cout << left << setw(10) << c.code
-                 << setw(20) << c.name
-                 << setw(13) << c.phone
-                 << c.address << "\n";
+        cout << "Order by (1=as entered, 2=code, 3=name): ";
+        string s; getline(cin,s);
+        const char* header = "Code       Name                Phone         Address\n"
+                             "--------------------------------------------------------------\n";
+        if(s=="2" || s=="3")
+            show_cursor_pages(header,
+                              [&](const TextCursor* after, size_t n){ return customer_page(s=="3", after, n); },
+                              [&](auto &e){ return customer_row(customers[e.second]); });
+        else {
+            vector<uint32_t> live;
+            for(size_t i=0;i<customers.size();++i) if(customer_live(i)) live.push_back(i);
+            show_pages(header, live.size(), [&](size_t i){ return customer_row(customers[live[i]]); });
         }
-        wait_key();
     }
 
     /* ---------- Invoice ---------- */
 
+    // Numbers reserved in bulk by run_batch(); handed out before asking
+    // the counter file for more. An earlier line of the batch may give an
+    // invoice its own number inside the block; note() records it and it
+    // is skipped. Numbers still in the block when the batch ends (its
+    // lines were rejected) are not handed out again, so the series has a
+    // gap there, as it does when a process stops between reserving a
+    // number and recording it.
+    struct NumberBlock {
+        long long next=0, end=0;
+        set<long long> given;
+        void note(long long n){ if(n>=next && n<end) given.insert(n); }
+    };
+    NumberBlock invoice_block, dispatch_block;
+
+    string take_number(NumberBlock &b, const char* series){
+        LatencyTimer t(M_NEXT_NUMBER);
+        while(b.next<b.end){
+            long long n = b.next++;
+            if(!b.given.count(n)) return to_string(n);
+        }
+        return to_string(fm.sequences.reserve(series));
+    }
+
     string generate_invoice_number(){
-        int maxn = 0;
-        for(auto &i: invoices){
-            try{
-                int x = stoi(i.number);
-                maxn = max(maxn, x);
-            }catch(...){}
+        return take_number(invoice_block, "invoice");
+    }
+
+    // Records an invoice for customer with the given items; purchase
+    // invoices add them to stock. An empty number is filled from the
+    // counter. Returns an error message, or "" on success.
+    // Creating products for unknown codes needs the tables exclusively.
+    string apply_invoice(Invoice &inv, const string &customer, const vector<ItemLine> &items){
+        LatencyTimer t(M_CREATE_INVOICE);
+        if(inv.type!="purchase" && inv.type!="sale") return "Invalid type.";
+        if(!plain_text(customer)) return "Customer code must not contain control characters.";
+        for(auto &it: items){
+            if(it.product.empty()) return "Item without product.";
+            if(!plain_text(it.product)) return "Product codes must not contain control characters.";
+            if(it.qty<=0) return it.product + ": Quantity must be positive.";
+        }
+
+        bool given = !inv.number.empty();
+        if(!given) inv.number = generate_invoice_number();
+        {
+            lock_guard<mutex> lk(history_lock);
+            if(given && find_invoice(inv.number)) return "Invoice number already exists.";
+            inv.customer = codes.intern(customer);
+            inv.items = ItemSpan::of(items);
+            add_invoice(inv);
+        }
+        if(given){
+            fm.sequences.observe("invoice", number_value(inv.number));
+            invoice_block.note(number_value(inv.number));
+        }
+
+        if(inv.type=="purchase"){
+            for(auto &it: inv.items){
+                Product* p = find_product(it.product);
+                if(p) adjust_stock(*p, it.qty);
+                else {
+                    Product np;
+                    np.code = it.product_code();
+                    np.name = np.code;
+                    np.description = "Auto-created";
+                    np.qty = it.qty;
+                    log_product(insert_product(np));
+                }
+            }
         }
-        return to_string(maxn+1);
+
+        log_invoice(inv);
+        return "";
     }
 
     void create_invoice(){
         Invoice inv;
 
-        inv.number = generate_invoice_number();
         inv.date = today_str();
 
         cout << "Invoice type (purchase/sale): ";
@@ -708,76 +4211,129 @@ struct App {
         }
 
         cout << "Customer code (optional): ";
-        getline(cin,inv.customer_code);
+        string cc; getline(cin,cc);
 
         cout << "Add items in format: product_code,qty\n";
         cout << "Leave empty line to finish.\n";
 
+        vector<ItemLine> items;
         while(true){
             cout << "Item: ";
             string line; getline(cin,line);
             if(line.empty()) break;
 
             auto p = split(line, ',');
-            if(p.size()<2){ cout<<"Invalid.\n"; continue; }
+            long long qty;
+            if(p.size()<2 || !parse_qty(p[1], qty)){ cout<<"Invalid.\n"; continue; }
+            if(p[0].empty()){ cout<<"Item without product.\n"; continue; }
+            if(qty<=0){ cout<<"Quantity must be positive.\n"; continue; }
 
-            InvoiceItem it;
-            it.product_code = p[0];
-            it.qty = stoll(p[1]);
-
-            inv.items.push_back(it);
-        }
-
-        if(inv.type=="purchase"){
-            for(auto &it: inv.items){
-                Product* p = find_product(it.product_code);
-                if(p) p->qty += it.qty;
-                else {
-                    Product np;
-                    np.code = it.product_code;
-                    np.name = it.product_code;
-                    np.description = "Auto-created";
-                    np.qty = it.qty;
-                    products.push_back(np);
-                }
-            }
-            invoices.push_back(inv);
-            fm.save_products(products);
-            fm.save_invoices(invoices);
-            cout << "Purchase invoice saved. Stock increased.\n";
-            wait_key();
-            return;
+            items.push_back({p[0], qty});
         }
 
-        invoices.push_back(inv);
-        fm.save_invoices(invoices);
+        string err = apply_invoice(inv, cc, items);
+        if(err.empty()) err = commit();
+        if(!err.empty()){ cout << err << "\n"; wait_key(); return; }
 
-        cout << "Sale invoice saved (dispatch needed to decrease stock).\n";
+        if(inv.type=="purchase")
+            cout << "Purchase invoice saved. Stock increased.\n";
+        else
+            cout << "Sale invoice saved (dispatch needed to decrease stock).\n";
         wait_key();
     }
 
     /* ---------- Dispatch ---------- */
 
     string generate_dispatch_number(){
-        int maxn = 0;
-        for(auto &d: dispatches){
-            try{
-                int x = stoi(d.number);
-                maxn = max(maxn, x);
-            }catch(...){}
+        return take_number(dispatch_block, "dispatch");
+    }
+
+    // Callers running alongside other sessions hold history_lock.
+    map<uint32_t,long long> dispatched_for_invoice(const string &inv){
+        LatencyTimer t(M_DISPATCHED_FOR_INVOICE);
+        auto it = dispatched_index.find(inv);
+        return it==dispatched_index.end() ? map<uint32_t,long long>() : it->second;
+    }
+
+    map<uint32_t,long long> ordered_for_invoice(const Invoice &inv){
+        map<uint32_t,long long> ordered;
+        for(auto &it: inv.items)
+            ordered[it.product] += it.qty;
+        return ordered;
+    }
+
+    // Checks one dispatch line against what the invoice still allows and
+    // the stock left after the lines already accepted (pending). On
+    // success the line is counted in already/pending and it holds it as
+    // an item. Returns an error message, or "" when the line is accepted.
+    string check_dispatch_item(const ItemLine &l, InvoiceItem &it, map<uint32_t,long long> &ordered,
+                               map<uint32_t,long long> &already, map<uint32_t,long long> &pending){
+        if(l.qty<=0) return "Quantity must be positive.";
+        // A code that is in no record is on no invoice either.
+        if(!InvoiceItem::lookup(l, it)) return "Exceeds ordered amount. Allowed = 0";
+
+        long long ord = ordered[it.product];
+        long long alr = already[it.product];
+
+        if(alr + it.qty > ord)
+            return "Exceeds ordered amount. Allowed = " + to_string(ord - alr);
+
+        Product* pr = find_product(it.product);
+        if(!pr) return "Product not found.";
+
+        if(stock_of(*pr) - pending[it.product] < it.qty)
+            return "Not enough stock.";
+
+        already[it.product] += it.qty;
+        pending[it.product] += it.qty;
+        return "";
+    }
+
+    // Numbers, stores and logs a dispatch whose lines were all accepted by
+    // check_dispatch_item(), taking the quantities out of stock. Other
+    // sessions may have taken the stock since the check, so this can
+    // still fail; nothing is recorded then. Returns an error message, or
+    // "" on success.
+    string record_dispatch(Dispatch &d, const vector<InvoiceItem> &items){
+        string err = reserve_stock(ItemSpan{items.data(), (uint32_t)items.size()});
+        if(!err.empty()) return err;
+
+        d.items = ItemSpan::of(items);
+        d.number = generate_dispatch_number();
+        {
+            lock_guard<mutex> lk(history_lock);
+            add_dispatch(d);
         }
-        return to_string(maxn+1);
+        log_dispatch(d);
+        return "";
     }
 
-    map<string,long long> dispatched_for_invoice(const string &inv){
-        map<string,long long> out;
-        for(auto &d: dispatches){
-            if(d.invoice_number == inv){
-                for(auto &it: d.items)
-                    out[it.product_code] += it.qty;
-            }
+    // Validates every line and records d with them only if all are
+    // accepted. Returns an error message, or "" on success.
+    string apply_dispatch(Dispatch &d, const vector<ItemLine> &lines){
+        LatencyTimer t(M_CREATE_DISPATCH);
+        lock_guard<mutex> inv_lock(invoice_lock(d.invoice_number));
+
+        map<uint32_t,long long> ordered, already, pending;
+        {
+            lock_guard<mutex> lk(history_lock);
+            Invoice* inv = find_invoice(d.invoice_number);
+            if(!inv) return "Invoice not found.";
+            if(inv->type!="sale") return "Dispatch allowed only for sale invoices.";
+            if(d.date < inv->date) return "Dispatch date is before the invoice date.";
+            ordered = ordered_for_invoice(*inv);
+            ensure_from(month_of(inv->date));
+            already = dispatched_for_invoice(d.invoice_number);
         }
-        return out;
+
+        vector<InvoiceItem> items(lines.size());
+        for(size_t i=0;i<lines.size();++i){
+            string err = check_dispatch_item(lines[i], items[i], ordered, already, pending);
+            if(!err.empty()) return lines[i].product + ": " + err;
+        }
+        if(items.empty()) return "Nothing dispatched.";
+
+        return record_dispatch(d, items);
     }
 
     void create_dispatch(){
@@ -791,70 +4347,58 @@ struct App {
             cout << "Dispatch allowed only for sale invoices.\n"; wait_key(); return;
         }
 
-        map<string,long long> ordered;
-        for(auto &it: inv->items)
-            ordered[it.product_code] += it.qty;
+        Dispatch d;
+        d.invoice_number = invno;
+        d.date = today_str();
+        if(d.date < inv->date){
+            cout << "Dispatch date is before the invoice date.\n"; wait_key(); return;
+        }
+
+        map<uint32_t,long long> ordered = ordered_for_invoice(*inv);
+        ensure_from(month_of(inv->date));
+        map<uint32_t,long long> already = dispatched_for_invoice(invno);
+        map<uint32_t,long long> pending;
 
-        map<string,long long> already = dispatched_for_invoice(invno);
+        // Listed by code, as the ids carry no order.
+        vector<pair<string,uint32_t>> lines;
+        for(auto &kv: ordered) lines.emplace_back(codes.str(kv.first), kv.first);
+        sort(lines.begin(), lines.end());
 
         cout << "Ordered vs Already Dispatched:\n";
-        for(auto &kv: ordered){
-            cout << kv.first << " -> "
-                 << "Ordered=" << kv.second
-                 << ", Dispatched=" << already[kv.first] << "\n";
+        for(auto &l: lines){
+            cout << l.first << " -> "
+                 << "Ordered=" << ordered[l.second]
+                 << ", Dispatched=" << already[l.second] << "\n";
         }
 
-        Dispatch d;
-        d.number = generate_dispatch_number();
-        d.invoice_number = invno;
-        d.date = today_str();
-
         cout << "Add dispatch items (product,qty). Empty line ends.\n";
 
+        // Lines are checked as they are typed, then the whole dispatch
+        // goes through apply_dispatch() like a batch or server one.
+        vector<ItemLine> items;
         while(true){
             cout << "Item: ";
             string line; getline(cin,line);
             if(line.empty()) break;
 
             auto p = split(line, ',');
-            if(p.size()<2){ cout<<"Invalid.\n"; continue; }
+            long long qty;
+            if(p.size()<2 || !parse_qty(p[1], qty)){ cout<<"Invalid.\n"; continue; }
 
             InvoiceItem it;
-            it.product_code = p[0];
-            it.qty = stoll(p[1]);
+            string err = check_dispatch_item({p[0], qty}, it, ordered, already, pending);
+            if(!err.empty()){ cout << err << "\n"; continue; }
 
-            long long ord = ordered[it.product_code];
-            long long alr = already[it.product_code];
-
-            if(alr + it.qty > ord){
-                cout << "Exceeds ordered amount. Allowed = "
-                     << (ord - alr) << "\n";
-                continue;
-            }
-
-            Product* pr = find_product(it.product_code);
-            if(!pr){ cout << "Product not found.\n"; continue; }
-
-            if(pr->qty < it.qty){
-                cout << "Not enough stock.\n"; continue;
-            }
-
-            d.items.push_back(it);
-            already[it.product_code] += it.qty;
+            items.push_back({p[0], qty});
         }
 
-        if(d.items.empty()){
+        if(items.empty()){
             cout << "Nothing dispatched.\n"; wait_key(); return;
         }
 
-        for(auto &it: d.items){
-            Product* p = find_product(it.product_code);
-            p->qty -= it.qty;
-        }
-
-        dispatches.push_back(d);
-        fm.save_dispatches(dispatches);
-        fm.save_products(products);
+        string err = apply_dispatch(d, items);
+        if(err.empty()) err = commit();
+        if(!err.empty()){ cout << err << "\n"; wait_key(); return; }
 
         cout << "Dispatch saved. Stock updated.\n";
         wait_key();
@@ -881,6 +4425,25 @@ struct App {
         }
     }
 
+    // Moves qty of product pc from stock to customer cc's consignment.
+    // Returns an error message, or "" on success.
+    string apply_consignment(const string &cc, const string &pc, long long qty){
+        if(!find_customer(cc)) return "Customer not found.";
+
+        Product* p = find_product(pc);
+        if(!p) return "Product not found.";
+
+        if(qty<=0) return "Quantity must be positive.";
+
+        if(!take_stock(*p, qty)) return "Not enough stock.";
+        log_product(*p);
+
+        lock_guard<mutex> lk(consignment_lock);
+        long long total = consignment.add(codes.intern(cc), codes.intern(pc), qty);
+        log_consignment(cc, pc, total);
+        return "";
+    }
+
     void add_consignment(){
         cout << "Customer code: ";
         string cc; getline(cin,cc);
@@ -892,32 +4455,16 @@ struct App {
         cout << "Product code: ";
         string pc; getline(cin,pc);
 
-        Product* p = find_product(pc);
-        if(!p){ cout<<"Product not found.\n"; wait_key(); return; }
+        if(!find_product(pc)){ cout<<"Product not found.\n"; wait_key(); return; }
 
         cout << "Quantity: ";
         string q; getline(cin,q);
-        long long qty = stoll(q);
-
-        if(p->qty < qty){
-            cout << "Not enough stock.\n"; wait_key(); return;
-        }
-
-        p->qty -= qty;
-
-        bool merged=false;
-        for(auto &t: consignment){
-            if(get<0>(t)==cc && get<1>(t)==pc){
-                get<2>(t) += qty;
-                merged=true;
-                break;
-            }
-        }
-        if(!merged)
-            consignment.emplace_back(cc,pc,qty);
+        long long qty;
+        if(!parse_qty(q, qty)){ cout<<"Invalid quantity.\n"; wait_key(); return; }
 
-        fm.save_products(products);
-        fm.save_consignment(consignment);
+        string err = apply_consignment(cc, pc, qty);
+        if(err.empty()) err = commit();
+        if(!err.empty()){ cout << err << "\n"; wait_key(); return; }
 
         cout<<"Consignment added.\n";
         wait_key();
@@ -930,51 +4477,1259 @@ struct App {
         cout<<"Product   Qty\n";
         cout<<"---------------------\n";
 
-        for(auto &t: consignment){
-            if(get<0>(t)==cc)
-                cout << left << setw(10) << get<1>(t)
-                     << get<2>(t) << "\n";
+        uint32_t id;
+        if(codes.find(cc, id)){
+            for(size_t i: consignment.for_customer(id)){
+                auto &e = consignment.entries[i];
+                cout << left << setw(10) << codes.str(e.product)
+                     << e.qty << "\n";
+            }
         }
         wait_key();
     }
 
-    void consignment_by_product(){
-        map<string,long long> agg;
-        for(auto &t: consignment)
-            agg[get<1>(t)] += get<2>(t);
-
-        cout<<"Product   Total Consignment\n";
-        cout<<"---------------------------------\n";
+    static constexpr const char* CONSIGNMENT_HEADER =
+        "Product   Total Consignment\n"
+        "---------------------------------\n";
 
-        for(auto &kv: agg)
-            cout << left << setw(10) << kv.first << kv.second << "\n";
+    void write_consignment_by_product(BulkWriter &out){
+        out << CONSIGNMENT_HEADER;
+        for(auto *row: consignment.total_rows()) out << *row;
+    }
 
-        wait_key();
+    void consignment_by_product(){
+        auto rows = consignment.total_rows();
+        show_pages(CONSIGNMENT_HEADER, rows.size(), [&](size_t i) -> const string& { return *rows[i]; });
     }
 
     /* ---------- Inventory ---------- */
 
+    static constexpr const char* INVENTORY_HEADER =
+        "Code       Name                 Qty       Description\n"
+        "------------------------------------------------------------\n";
+
+    void write_inventory_report(BulkWriter &out){
+        out << INVENTORY_HEADER;
+        for(auto &row: columns.report_rows()) out << row;
+    }
+
     void inventory_report(){
-        cout<<"Code       Name                 Qty       Description\n";
-        cout<<"------------------------------------------------------------\n";
-        for(auto &p: products){
-            cout << left << setw(10) << p.code
-                 << setw(20) << p.name
-                 << setw(10) << p.qty
-                 << p.description << "\n";
+        show_product_rows(INVENTORY_HEADER);
+    }
+
+    /* ---------- History Queries ---------- */
+
+    struct Movement { long long sold = 0, dispatched = 0; };
+
+    // Units per product on sale invoices and on dispatches dated from..to
+    // (YYYY-MM-DD, inclusive), by code. Only the months in the range are
+    // looked at; those not in memory yet are read in.
+    map<string,Movement> sales_by_product(const string &from, const string &to){
+        unordered_map<uint32_t,Movement> by_id;
+        {
+            lock_guard<mutex> lk(history_lock);
+            auto first = history_months.lower_bound(month_of(from));
+            auto last = history_months.upper_bound(month_of(to));
+            vector<string> months(first, last);
+            for(auto &m: months){
+                ensure_month(m);
+                for(size_t i: invoice_months[m]){
+                    const Invoice &inv = invoices[i];
+                    if(inv.type!="sale" || inv.date<from || inv.date>to) continue;
+                    for(auto &it: inv.items) by_id[it.product].sold += it.qty;
+                }
+                for(size_t i: dispatch_months[m]){
+                    const Dispatch &d = dispatches[i];
+                    if(d.date<from || d.date>to) continue;
+                    for(auto &it: d.items) by_id[it.product].dispatched += it.qty;
+                }
+            }
+        }
+        map<string,Movement> out;
+        for(auto &kv: by_id) out[codes.str(kv.first)] = kv.second;
+        return out;
+    }
+
+    void sales_report(){
+        cout << "From date (YYYY-MM-DD): ";
+        string from; getline(cin,from);
+        cout << "To date (YYYY-MM-DD): ";
+        string to; getline(cin,to);
+        if(from.empty() || to.empty() || to<from){
+            cout << "Invalid range.\n"; wait_key(); return;
+        }
+
+        vector<string> rows;
+        for(auto &kv: sales_by_product(from, to)){
+            string r;
+            put_field(r, kv.first, 10);
+            size_t at = r.size();
+            put_int(r, kv.second.sold);
+            if(r.size()-at<10) r.append(10-(r.size()-at), ' ');
+            put_int(r, kv.second.dispatched);
+            r.push_back('\n');
+            rows.push_back(move(r));
+        }
+        show_pages("Product   Sold      Dispatched\n"
+                   "---------------------------------\n",
+                   rows.size(), [&](size_t i) -> const string& { return rows[i]; });
+    }
+
+    /* ---------- Report Pages ---------- */
+
+    static constexpr size_t PAGE_ROWS = 40;
+
+    // Shows header and rows row(0..n-1) a page at a time: Enter shows the
+    // next page, q stops. A report that fits one page looks as before.
+    template<class Row>
+    void show_pages(const char* header, size_t n, Row row){
+        size_t pages = max<size_t>(1, (n + PAGE_ROWS - 1) / PAGE_ROWS);
+        for(size_t pg=0; pg<pages; ++pg){
+            {
+                cout << flush;
+                BulkWriter out(stdout);
+                out << header;
+                for(size_t i=pg*PAGE_ROWS; i<min(n, (pg+1)*PAGE_ROWS); ++i) out << row(i);
+            }
+            fflush(stdout);
+            if(pg+1==pages) break;
+            cout << "-- Page " << pg+1 << " of " << pages << ": Enter for more, q to stop -- ";
+            string s; getline(cin, s);
+            if(s=="q" || s=="Q") break;
+        }
+        wait_key();
+    }
+
+    // The same for listings read from an OrderedIndex, whose length isn't
+    // known up front: page(after, n) returns the entries following after,
+    // and each page resumes from the last row shown.
+    template<class Page, class Row>
+    void show_cursor_pages(const char* header, Page page, Row row){
+        auto got = page(nullptr, PAGE_ROWS+1);
+        while(true){
+            bool more = got.size()>PAGE_ROWS;
+            if(more) got.resize(PAGE_ROWS);
+            {
+                cout << flush;
+                BulkWriter out(stdout);
+                out << header;
+                for(auto &e: got) out << row(e);
+            }
+            fflush(stdout);
+            if(!more) break;
+            cout << "-- Enter for more, q to stop -- ";
+            string s; getline(cin, s);
+            if(s=="q" || s=="Q") break;
+            auto last = got.back();
+            got = page(&last, PAGE_ROWS+1);
         }
         wait_key();
     }
+
+    /* ---------- Export ---------- */
+
+    /*
+      --export inventory|customers|consignment csv|json FILE writes a report
+      for other tools: CSV with a header line, or a JSON array with one
+      object per line. The inventory and customers CSV files can be read
+      back by --import. Returns an error message, or "" on success.
+    */
+    string export_report(const string &kind, const string &format, const string &path){
+        bool json = format=="json";
+        if(!json && format!="csv") return "Format must be csv or json.";
+        if(kind!="inventory" && kind!="customers" && kind!="consignment")
+            return "Report must be inventory, customers or consignment.";
+
+        BulkWriter out(path);
+        string line;
+        size_t n = 0;
+        auto emit = [&]{
+            if(json){ out << (n++ ? ",\n" : "[\n") << line; }
+            else out << line << "\n";
+            line.clear();
+        };
+
+        if(kind=="inventory"){
+            if(!json) out << "code,name,qty,description\n";
+            for(size_t i=0;i<columns.size();++i){
+                if(!product_live(i)) continue;
+                if(json){
+                    line += "{\"code\":"; put_json(line, columns.code(i));
+                    line += ",\"name\":"; put_json(line, columns.pool.get(columns.name[i]));
+                    line += ",\"qty\":"; put_int(line, columns.qty[i]);
+                    line += ",\"description\":"; put_json(line, columns.pool.get(columns.description[i]));
+                    line += "}";
+                } else {
+                    put_csv(line, columns.code(i)); line += ',';
+                    put_csv(line, columns.pool.get(columns.name[i])); line += ',';
+                    put_int(line, columns.qty[i]); line += ',';
+                    put_csv(line, columns.pool.get(columns.description[i]));
+                }
+                emit();
+            }
+        } else if(kind=="customers"){
+            if(!json) out << "code,name,phone,address\n";
+            for(size_t i=0;i<customers.size();++i){
+                if(!customer_live(i)) continue;
+                const Customer &c = customers[i];
+                if(json){
+                    line += "{\"code\":"; put_json(line, c.code);
+                    line += ",\"name\":"; put_json(line, c.name);
+                    line += ",\"phone\":"; put_json(line, c.phone);
+                    line += ",\"address\":"; put_json(line, c.address);
+                    line += "}";
+                } else {
+                    put_csv(line, c.code); line += ',';
+                    put_csv(line, c.name); line += ',';
+                    put_csv(line, c.phone); line += ',';
+                    put_csv(line, c.address);
+                }
+                emit();
+            }
+        } else {
+            if(!json) out << "product,qty\n";
+            for(auto &kv: consignment.product_totals){
+                if(json){
+                    line += "{\"product\":"; put_json(line, kv.first);
+                    line += ",\"qty\":"; put_int(line, kv.second.qty);
+                    line += "}";
+                } else {
+                    put_csv(line, kv.first); line += ',';
+                    put_int(line, kv.second.qty);
+                }
+                emit();
+            }
+        }
+        if(json) out << (n ? "\n]\n" : "[]\n");
+        return "";
+    }
+
+    /* ---------- Import ---------- */
+
+    /*
+      --import products|customers FILE adds the rows of a CSV file whose
+      header line names its columns: code,name,description,qty or
+      code,name,phone,address, in any order, as --export writes them. The
+      file is mapped and parsed in chunks on several threads, each row
+      checked the way add_product()/add_customer() check their prompts;
+      rejected rows are reported by line and skipped. The rest are inserted
+      in one pass, which also catches codes repeated within the file, and
+      saved once. Returns an error message, or "" once the file was read.
+    */
+    static constexpr size_t IMPORT_REPORTED = 20;
+
+    template<class T>
+    struct ImportRow {
+        T rec;
+        const char* at = nullptr;   // where the row starts in the file
+        string error;
+    };
+
+    static string import_fields(Product &p, const array<string_view,4> &f){
+        p.code = unquote(f[0]);
+        p.name = unquote(f[1]);
+        p.description = unquote(f[2]);
+        if(!parse_qty(unquote(f[3]), p.qty)) return "qty must be a whole number.";
+        return "";
+    }
+
+    static string import_fields(Customer &c, const array<string_view,4> &f){
+        c.code = unquote(f[0]);
+        c.name = unquote(f[1]);
+        c.phone = unquote(f[2]);
+        c.address = unquote(f[3]);
+        return "";
+    }
+
+    bool exists(const Product &p){ return find_product(p.code); }
+    bool exists(const Customer &c){ return find_customer(c.code); }
+
+    string import_table(const string &table, const string &path){
+        if(table=="products") return import_rows<Product>(table, path, {"code","name","description","qty"});
+        if(table=="customers") return import_rows<Customer>(table, path, {"code","name","phone","address"});
+        return "Table must be products or customers.";
+    }
+
+    template<class T>
+    string import_rows(const string &table, const string &path, const array<const char*,4> &names){
+        auto t0 = chrono::steady_clock::now();
+        MappedFile f(path);
+        if(!f.data) return "Cannot read " + path + ".";
+        string_view text = f.view();
+        size_t eol = find_newline(text, 0);
+        vector<string_view> head;
+        split_view(trim_view(text.substr(0, eol)), ',', head);
+        array<size_t,4> col;
+        size_t width = 0;
+        for(size_t k=0;k<4;++k){
+            auto it = find_if(head.begin(), head.end(), [&](string_view h){ return unquote(h)==names[k]; });
+            if(it==head.end()) return path + ": the header has no " + names[k] + " column.";
+            col[k] = it - head.begin();
+            width = max(width, col[k]+1);
+        }
+        string_view body = text.substr(min(text.size(), eol+1));
+
+        // Validation only reads the tables, so the chunks run concurrently.
+        auto rows = fm.parse_records<ImportRow<T>>(path, body, [&](const vector<string_view> &fields, vector<ImportRow<T>> &out){
+            ImportRow<T> r;
+            r.at = fields[0].data();
+            if(fields.size()<width) r.error = "Expected " + to_string(width) + " fields.";
+            else {
+                string err = import_fields(r.rec, {fields[col[0]], fields[col[1]], fields[col[2]], fields[col[3]]});
+                if(r.rec.code.empty()) r.error = "Missing code.";
+                else if(!r.rec.plain()) r.error = "Text must not contain control characters.";
+                else if(!err.empty()) r.error = err;
+                else if(exists(r.rec)) r.error = "Code already exists.";
+            }
+            out.push_back(move(r));
+            return string();
+        });
+
+        size_t fresh = count_if(rows.begin(), rows.end(), [](const ImportRow<T> &r){ return r.error.empty(); });
+        if constexpr(is_same_v<T, Product>) reserve_products(fresh);
+        else reserve_customers(fresh);
+
+        // Only the first rejected rows are reported by line; a file of
+        // another layout would otherwise print one line per row.
+        size_t added = 0, rejected = 0, line = 2;
+        const char* counted = body.data();
+        for(auto &r: rows){
+            if(r.error.empty() && exists(r.rec)) r.error = "Code repeated in the file.";
+            if(!r.error.empty()){
+                if(++rejected > IMPORT_REPORTED) continue;
+                line += count(counted, r.at, '\n');
+                counted = r.at;
+                cerr << path << ":" << line << ": " << r.error << "\n";
+                continue;
+            }
+            insert_record(r.rec);
+            added++;
+        }
+        if(rejected > IMPORT_REPORTED)
+            cerr << path << ": " << rejected-IMPORT_REPORTED << " more rows rejected\n";
+        if(added) save_all();
+
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        cout << "Imported " << added << " of " << rows.size() << " rows into " << table << " in "
+             << fixed << setprecision(2) << secs << " s ("
+             << (size_t)(rows.size() / max(secs, 1e-9)) << " rows/sec)";
+        if(added<rows.size()) cout << ", " << rows.size()-added << " rejected";
+        cout << ".\n";
+        return "";
+    }
+
+    void insert_record(const Product &p){ insert_product(p); }
+    void insert_record(const Customer &c){ insert_customer(c); }
+
+    /* ---------- Batch ---------- */
+
+    /*
+      Headless ingestion of newline-delimited JSON commands:
+        {"op":"invoice","type":"sale","customer":"C1","items":[{"product":"P1","qty":5}]}
+        {"op":"dispatch","invoice":"12","items":[{"product":"P1","qty":2}]}
+        {"op":"consignment","customer":"C1","product":"P1","qty":3}
+        {"op":"product","code":"P1","name":"Widget","description":"Blue","qty":10}
+        {"op":"stock","product":"P1"}
+        {"op":"sales","from":"2024-01-01","to":"2024-03-31"}
+        {"op":"search","table":"products","q":"blue wid","limit":20}
+        {"op":"list","table":"products","order":"qty","limit":20}
+        {"op":"list","table":"customers","order":"name","after":{"key":"Ann","code":"C7"}}
+        {"op":"metrics"}     (writes the --metrics file now)
+      Invoices may carry their own "number" and any command a "date";
+      numbers for the rest are reserved for the whole batch at once, and
+      those meant for rejected lines stay unused.
+      "product" adds a product or updates the fields it names.
+      "list" pages a table by code, name or (products) qty, lowest first;
+      its reply carries the "next" cursor to pass back as "after".
+      Each line is validated like its menu counterpart; rejected lines are
+      reported and skipped, and everything accepted is persisted by one
+      commit() at the end.
+    */
+
+    static string json_str(const Json &cmd, const string &key){
+        const Json* v = cmd.get(key);
+        return v && v->kind==Json::STR ? v->text : string();
+    }
+
+    static bool json_int(const Json* v, long long &out){
+        if(!v || v->kind!=Json::NUM) return false;
+        auto r = from_chars(v->text.data(), v->text.data()+v->text.size(), out);
+        return r.ec==errc() && r.ptr==v->text.data()+v->text.size();
+    }
+
+    static string json_items(const Json &cmd, vector<ItemLine> &out){
+        const Json* arr = cmd.get("items");
+        if(!arr || arr->kind!=Json::ARR) return "Missing items.";
+        for(auto &e: arr->arr){
+            string code = json_str(e, "product");
+            if(code.empty()) return "Item without product.";
+            long long qty;
+            if(!json_int(e.get("qty"), qty)) return "Item " + code + " has no integer qty.";
+            out.push_back({code, qty});
+        }
+        return "";
+    }
+
+    // True when cmd may add products or edit their text, so it must run
+    // with the tables to itself.
+    bool changes_tables(const Json &cmd){
+        string op = json_str(cmd, "op");
+        if(op=="product") return true;
+        if(op!="invoice" || json_str(cmd, "type")!="purchase") return false;
+        const Json* arr = cmd.get("items");
+        if(arr && arr->kind==Json::ARR)
+            for(auto &e: arr->arr)
+                if(!find_product(json_str(e, "product"))) return true;
+        return false;
+    }
+
+    // Applies one parsed command. Returns an error message, or "" on
+    // success; reply, if given, receives extra JSON members for the caller.
+    string run_command(const Json &cmd, string *reply = nullptr){
+        if(cmd.kind!=Json::OBJ) return "Command must be a JSON object.";
+        string ignored;
+        if(!reply) reply = &ignored;
+        string op = json_str(cmd, "op");
+        string date = json_str(cmd, "date");
+        if(date.empty()) date = today_str();
+
+        if(op=="invoice"){
+            Invoice inv;
+            inv.number = json_str(cmd, "number");
+            inv.type = json_str(cmd, "type");
+            inv.date = date;
+            vector<ItemLine> items;
+            string err = json_items(cmd, items);
+            if(err.empty()) err = apply_invoice(inv, json_str(cmd, "customer"), items);
+            if(err.empty()) *reply = "\"number\":" + json_quote(inv.number);
+            return err;
+        }
+        if(op=="dispatch"){
+            Dispatch d;
+            d.invoice_number = json_str(cmd, "invoice");
+            d.date = date;
+            vector<ItemLine> items;
+            string err = json_items(cmd, items);
+            if(err.empty()) err = apply_dispatch(d, items);
+            if(err.empty()) *reply = "\"number\":" + json_quote(d.number);
+            return err;
+        }
+        if(op=="consignment"){
+            long long qty;
+            if(!json_int(cmd.get("qty"), qty)) return "Missing integer qty.";
+            return apply_consignment(json_str(cmd, "customer"), json_str(cmd, "product"), qty);
+        }
+        if(op=="product"){
+            string code = json_str(cmd, "code");
+            if(code.empty()) return "Missing code.";
+            for(const char* f: {"code", "name", "description"})
+                if(!plain_text(json_str(cmd, f))) return string(f) + " must not contain control characters.";
+            long long qty = 0;
+            const Json* q = cmd.get("qty");
+            if(q && !json_int(q, qty)) return "qty must be an integer.";
+            const Json* name = cmd.get("name");
+            const Json* desc = cmd.get("description");
+
+            Product* p = find_product(code);
+            if(!p){
+                Product np;
+                np.code = code;
+                np.name = name ? json_str(cmd, "name") : code;
+                np.description = json_str(cmd, "description");
+                np.qty = qty;
+                log_product(insert_product(np));
+                return "";
+            }
+            if(name) p->name = json_str(cmd, "name");
+            if(desc) p->description = json_str(cmd, "description");
+            if(q) p->qty = qty;
+            product_changed(*p);
+            return "";
+        }
+        if(op=="sales"){
+            string from = json_str(cmd, "from"), to = json_str(cmd, "to");
+            if(from.empty() || to.empty() || to<from) return "Missing or invalid from/to dates.";
+            string sold, dispatched;
+            for(auto &kv: sales_by_product(from, to)){
+                sold += sold.empty() ? "{" : ",";
+                dispatched += dispatched.empty() ? "{" : ",";
+                put_json(sold, kv.first); sold += ":"; put_int(sold, kv.second.sold);
+                put_json(dispatched, kv.first); dispatched += ":"; put_int(dispatched, kv.second.dispatched);
+            }
+            if(sold.empty()) sold = dispatched = "{";
+            *reply = "\"sold\":" + sold + "},\"dispatched\":" + dispatched + "}";
+            return "";
+        }
+        if(op=="stock"){
+            string code = json_str(cmd, "product");
+            Product* p = find_product(code);
+            if(!p) return "Product not found.";
+            *reply = "\"qty\":" + to_string(stock_of(*p));
+            return "";
+        }
+        if(op=="search"){
+            string table = json_str(cmd, "table"), q = json_str(cmd, "q");
+            long long limit = 20;
+            const Json* l = cmd.get("limit");
+            if(l && (!json_int(l, limit) || limit<0)) return "limit must be a non-negative integer.";
+            string codes_out = "[";
+            auto add = [&](const string &code){
+                if(codes_out.size()>1) codes_out += ",";
+                put_json(codes_out, code);
+            };
+            if(table=="products") for(auto *p: search_products(q, limit)) add(p->code);
+            else if(table=="customers") for(auto *c: search_customers(q, limit)) add(c->code);
+            else return "table must be products or customers.";
+            *reply = "\"codes\":" + codes_out + "]";
+            return "";
+        }
+        if(op=="list"){
+            string table = json_str(cmd, "table"), order = json_str(cmd, "order");
+            if(order.empty()) order = "code";
+            long long limit = 20;
+            const Json* l = cmd.get("limit");
+            if(l && (!json_int(l, limit) || limit<0)) return "limit must be a non-negative integer.";
+            bool prod = table=="products";
+            if(!prod && table!="customers") return "table must be products or customers.";
+            if(order!="code" && order!="name" && (order!="qty" || !prod))
+                return prod ? "order must be code, name or qty." : "order must be code or name.";
+
+            // The cursor is the key and code of the last row of the previous
+            // page; if that code has since been deleted the rest of its key
+            // is skipped.
+            const Json* after = cmd.get("after");
+            if(after && after->kind!=Json::OBJ) return "after must be an object.";
+            uint32_t slot = UINT32_MAX;
+            if(after){
+                string code = json_str(*after, "code");
+                if(prod){ if(Product* p = find_product(code)) slot = slot_of(*p); }
+                else if(Customer* c = find_customer(code)) slot = c - customers.data();
+            }
+            auto code_of = [&](uint32_t i) -> const string& { return prod ? columns.code(i) : customers[i].code; };
+            string codes_out = "[", next = "null";
+            auto emit = [&](auto &got, auto key_json){
+                for(auto &e: got){
+                    if(codes_out.size()>1) codes_out += ",";
+                    put_json(codes_out, code_of(e.second));
+                }
+                if(!got.empty() && got.size()==(size_t)limit)
+                    next = "{\"key\":" + key_json(got.back().first)
+                         + ",\"code\":" + json_quote(code_of(got.back().second)) + "}";
+            };
+            if(order=="qty"){
+                QtyCursor cur{0, slot};
+                if(after && !json_int(after->get("key"), cur.first)) return "after.key must be an integer.";
+                auto got = columns.page_by_qty(after ? &cur : nullptr, limit);
+                emit(got, [](long long k){ return to_string(k); });
+            } else {
+                const Json* k = after ? after->get("key") : nullptr;
+                if(after && (!k || k->kind!=Json::STR)) return "after.key must be a string.";
+                TextCursor cur{k ? k->text : string(), slot};
+                const TextCursor* from = after ? &cur : nullptr;
+                auto got = !prod ? customer_page(order=="name", from, limit)
+                         : order=="name" ? columns.page_by_name(from, limit) : columns.page_by_code(from, limit);
+                emit(got, [](const string &k){ return json_quote(k); });
+            }
+            *reply = "\"codes\":" + codes_out + "],\"next\":" + next;
+            return "";
+        }
+        if(op=="metrics"){
+            string err = metrics.dump();
+            if(err.empty()) *reply = "\"file\":" + json_quote(metrics.path);
+            return err;
+        }
+        return "Unknown op '" + op + "'.";
+    }
+
+    // Returns the number of rejected lines, or of all lines when the
+    // changes could not be saved.
+    size_t run_batch(const string &path){
+        MappedFile f(path);
+        if(!f.data){ cerr << "Cannot read " << path << "\n"; return 1; }
+
+        struct Line { size_t no; Json cmd; string error; };
+        vector<Line> cmds;
+        size_t lineno=0, invoices_needed=0, dispatches_needed=0;
+        string_view text = f.view();
+        for(size_t pos=0; pos<text.size(); ){
+            size_t end = find_newline(text, pos);
+            string_view line = trim_view(text.substr(pos, end-pos));
+            pos = end+1;
+            lineno++;
+            if(line.empty()) continue;
+            try{
+                Json cmd = Json::parse(line);
+                string op = json_str(cmd, "op");
+                if(op=="invoice" && json_str(cmd, "number").empty()) invoices_needed++;
+                if(op=="dispatch") dispatches_needed++;
+                cmds.push_back({lineno, move(cmd), ""});
+            }catch(const exception &e){
+                cmds.push_back({lineno, Json(), e.what()});
+            }
+        }
+
+        // One counter update per series for the whole batch.
+        if(invoices_needed){
+            invoice_block.next = fm.sequences.reserve("invoice", invoices_needed);
+            invoice_block.end = invoice_block.next + invoices_needed;
+        }
+        if(dispatches_needed){
+            dispatch_block.next = fm.sequences.reserve("dispatch", dispatches_needed);
+            dispatch_block.end = dispatch_block.next + dispatches_needed;
+        }
+
+        size_t ok=0, failed=0;
+        for(auto &c: cmds){
+            string err = c.error.empty() ? run_command(c.cmd) : c.error;
+            if(err.empty()) ok++;
+            else { cerr << "line " << c.no << ": " << err << "\n"; failed++; }
+        }
+        string err = commit();
+        invoice_block = dispatch_block = NumberBlock();
+
+        cout << ok << " command(s) applied, " << failed << " rejected.\n";
+        if(!err.empty()){
+            cerr << err << "\n";
+            return ok + failed;
+        }
+        return failed;
+    }
+};
+
+/* ---------- Server ---------- */
+
+/*
+  --serve SOCKET keeps the data in one process and lets several clerks
+  work on it through a Unix-domain socket. Clients send the batch
+  commands, one JSON object per line, and get one line back for each:
+    {"ok":true,"number":"12"}
+    {"ok":false,"error":"P1: Not enough stock."}
+  A reply is sent only once its command is durable. Each connection has
+  its own thread; App's locks let sales, dispatches and consignments on
+  different products run side by side. SIGINT or SIGTERM stops accepting,
+  closes the sessions and saves the snapshots.
+*/
+#if !defined(_WIN32)
+struct Server {
+    App &app;
+    string path;
+    mutex mx;
+    condition_variable idle;
+    set<int> clients;
+
+    static inline volatile sig_atomic_t stop = 0, dump = 0;
+    static void on_signal(int){ stop = 1; }
+    static void on_dump(int){ dump = 1; }
+
+    Server(App &a, const string &p): app(a), path(p) {}
+
+    string handle(string_view line){
+        LatencyTimer t(M_REQUEST);
+        string err, extra;
+        try{
+            Json cmd = Json::parse(line);
+            shared_lock<shared_mutex> rd(app.tables);
+            if(app.changes_tables(cmd)){
+                rd.unlock();
+                unique_lock<shared_mutex> wr(app.tables);
+                err = app.run_command(cmd, &extra);
+            } else {
+                err = app.run_command(cmd, &extra);
+                rd.unlock();
+            }
+            string saved = app.commit_shared();
+            if(err.empty()) err = saved;
+        }catch(const exception &e){
+            err = e.what();
+        }
+        if(!err.empty()) return "{\"ok\":false,\"error\":" + json_quote(err) + "}\n";
+        return "{\"ok\":true" + (extra.empty() ? "" : "," + extra) + "}\n";
+    }
+
+    static bool send_all(int fd, const string &s){
+        for(size_t off=0; off<s.size(); ){
+            ssize_t n = ::send(fd, s.data()+off, s.size()-off, MSG_NOSIGNAL);
+            if(n<=0) return false;
+            off += n;
+        }
+        return true;
+    }
+
+    // Pipelined commands are answered in order, one write per read.
+    void session(int fd){
+        string buf, out;
+        char chunk[4096];
+        while(true){
+            ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if(n<=0) break;
+            buf.append(chunk, n);
+            size_t start=0, nl;
+            out.clear();
+            while((nl = buf.find('\n', start))!=string::npos){
+                string_view line = trim_view(string_view(buf).substr(start, nl-start));
+                start = nl+1;
+                if(!line.empty()) out += handle(line);
+            }
+            buf.erase(0, start);
+            if(!send_all(fd, out) || buf.size() > (1<<20)) break;
+        }
+        lock_guard<mutex> lk(mx);
+        clients.erase(fd);
+        ::close(fd);
+        idle.notify_all();
+    }
+
+    int run(){
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if(path.size() >= sizeof(addr.sun_path)){ cerr << "Socket path too long.\n"; return 1; }
+        memcpy(addr.sun_path, path.c_str(), path.size()+1);
+
+        int lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ::unlink(path.c_str());
+        if(lfd<0 || ::bind(lfd, (sockaddr*)&addr, sizeof(addr))!=0 || ::listen(lfd, 64)!=0){
+            cerr << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+
+        // No SA_RESTART, so the signal interrupts accept(); sessions block
+        // these signals so it is always the accepting thread that gets them.
+        // SIGUSR1 writes the metrics file.
+        struct sigaction sa{};
+        sa.sa_handler = on_signal;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        sa.sa_handler = on_dump;
+        sigaction(SIGUSR1, &sa, nullptr);
+        sigset_t stop_signals, old;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        sigaddset(&stop_signals, SIGUSR1);
+
+        cout << "Serving on " << path << "\n" << flush;
+        while(!stop){
+            int fd = ::accept(lfd, nullptr, nullptr);
+            if(fd<0){
+                int e = errno;
+                if(dump){
+                    dump = 0;
+                    string err = metrics.dump();
+                    if(!err.empty()) cerr << err << "\n";
+                }
+                if(e==EINTR || e==ECONNABORTED) continue;
+                cerr << "accept: " << strerror(e) << "\n";
+                break;
+            }
+            lock_guard<mutex> lk(mx);
+            clients.insert(fd);
+            pthread_sigmask(SIG_BLOCK, &stop_signals, &old);
+            thread(&Server::session, this, fd).detach();
+            pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        }
+        ::close(lfd);
+        ::unlink(path.c_str());
+
+        {
+            unique_lock<mutex> lk(mx);
+            for(int fd: clients) ::shutdown(fd, SHUT_RDWR);
+            idle.wait(lk, [&]{ return clients.empty(); });
+        }
+        unique_lock<shared_mutex> wr(app.tables);
+        try{ app.save_all(); }
+        catch(const exception &e){
+            cerr << "Save failed: " << e.what() << ". Changes are kept in " << app.fm.journal_file << ".\n";
+            return 1;
+        }
+        cout << "Server stopped, data saved.\n";
+        return 0;
+    }
+};
+#endif
+
+/* ---------- Benchmarks ---------- */
+
+/*
+  --generate DIR ROWS writes a deterministic synthetic data set: ROWS
+  products and invoices, ROWS/10 customers and consignment lines, and
+  dispatches for about half of the sale invoices.
+  --bench DIR times the hot paths against a data set; it adds invoices
+  and dispatches to it, so point it at a scratch copy.
+*/
+
+struct Generator {
+    long long rows;
+    long long n_products, n_customers;
+
+    explicit Generator(long long r): rows(max(1LL, r)) {
+        n_products = rows;
+        n_customers = rows/10 + 1;
+    }
+
+    static string product_code(long long i){ return "P" + to_string(i); }
+    static string customer_code(long long i){ return "C" + to_string(i); }
+
+    static string date_of(long long i){
+        char buf[16];
+        snprintf(buf, sizeof(buf), "20%02lld-%02lld-%02lld", 20 + (i/336)%10, 1 + (i/28)%12, 1 + i%28);
+        return buf;
+    }
+
+    // Items of invoice i; seeded per invoice so the dispatch pass can
+    // regenerate them without keeping every invoice in memory.
+    vector<pair<long long,long long>> invoice_items(long long i) const {
+        mt19937_64 rng(0x9E3779B97F4A7C15ULL ^ (uint64_t)i);
+        vector<pair<long long,long long>> items(1 + rng()%5);
+        for(auto &it: items){ it.first = rng()%n_products; it.second = 1 + rng()%20; }
+        return items;
+    }
+
+    static bool is_sale(long long i){ return i%4!=0; }
+
+    void write(const string &dir){
+        filesystem::create_directories(dir);
+        mt19937_64 rng(42);
+        {
+            BulkWriter out(dir + "/products.txt");
+            for(long long i=0;i<n_products;++i){
+                out << product_code(i) << ",Product " << i << ",";
+                if(i%10==0) out << "\"Synthetic, item " << i << "\"";
+                else out << "Synthetic item " << i;
+                out << "," << (long long)(rng()%1000 + 100) << "\n";
+            }
+        }
+        {
+            BulkWriter out(dir + "/customers.txt");
+            for(long long i=0;i<n_customers;++i)
+                out << customer_code(i) << ",Customer " << i << ",555-" << (10000+i%90000)
+                    << ",\"" << i << " Main St, Springfield\"\n";
+        }
+        // History goes straight into month segments, appended in pieces
+        // so only a small buffer per month is held.
+        FileManager layout;
+        layout.history_dir = dir + "/" + layout.history_dir;
+        filesystem::remove_all(layout.history_dir);
+        filesystem::create_directories(layout.history_dir);
+        for(auto *f: {&layout.invoices_file, &layout.dispatches_file}){
+            filesystem::remove(dir + "/" + *f);
+            filesystem::remove(dir + "/" + FileManager::bin_path(*f));
+        }
+        map<string,string> inv_parts, dis_parts;
+        FileManager::MonthRanges inv_ranges, dis_ranges;
+        auto put = [&](map<string,string> &parts, const string &base, const string &month, const string &line, bool last){
+            string &buf = parts[month];
+            buf += line;
+            if(buf.size() > (64<<10) || last){
+                FILE* out = fopen(layout.segment_file(base, month).c_str(), "ab");
+                if(!out) throw runtime_error("cannot write " + layout.segment_file(base, month));
+                fwrite(buf.data(), 1, buf.size(), out);
+                fclose(out);
+                buf.clear();
+            }
+        };
+
+        long long n_dispatches=0;
+        for(long long i=0;i<rows;++i){
+            auto items = invoice_items(i);
+            string date = date_of(i);
+            string line = to_string(i+1) + "," + (is_sale(i) ? "sale" : "purchase") + "," + date
+                        + "," + customer_code(rng()%n_customers) + ",";
+            for(size_t k=0;k<items.size();++k)
+                line += (k ? ";" : "") + product_code(items[k].first) + ":" + to_string(items[k].second);
+            put(inv_parts, layout.invoices_file, month_of(date), line + "\n", false);
+            inv_ranges[month_of(date)].add(to_string(i+1));
+
+            if(is_sale(i) && i%2==1){
+                string ddate = max(date, date_of(i+1));   // dates wrap after ten years
+                line = to_string(++n_dispatches) + "," + to_string(i+1) + "," + ddate + ",";
+                for(size_t k=0;k<items.size();++k)
+                    line += (k ? ";" : "") + product_code(items[k].first) + ":" + to_string((items[k].second+1)/2);
+                put(dis_parts, layout.dispatches_file, month_of(ddate), line + "\n", false);
+                dis_ranges[month_of(ddate)].add(to_string(n_dispatches));
+            }
+        }
+        for(auto &kv: inv_parts) put(inv_parts, layout.invoices_file, kv.first, "", true);
+        for(auto &kv: dis_parts) put(dis_parts, layout.dispatches_file, kv.first, "", true);
+        layout.save_ranges(inv_ranges, dis_ranges);
+
+        {
+            BulkWriter out(dir + "/consignment.txt");
+            for(long long i=0;i<rows/10;++i)
+                out << customer_code(i%n_customers) << "," << product_code(i%n_products) << ","
+                    << (long long)(1 + rng()%50) << "\n";
+        }
+        BulkWriter ctr(dir + "/counters.txt");
+        ctr << "dispatch " << n_dispatches << "\ninvoice " << rows << "\n";
+    }
 };
 
+void bench_report(const char* name, size_t iters, chrono::steady_clock::time_point t0){
+    double ns = chrono::duration<double,nano>(chrono::steady_clock::now()-t0).count();
+    printf("%-26s %10zu %12.2f ms %14.1f ns/op\n", name, iters, ns/1e6, iters ? ns/iters : 0.0);
+}
+
+template<class F>
+void bench(const char* name, size_t iters, F fn){
+    auto t0 = chrono::steady_clock::now();
+    for(size_t i=0;i<iters;++i) fn(i);
+    bench_report(name, iters, t0);
+}
+
+// Runs fn(t, i) for i < iters on each of threads threads at once.
+template<class F>
+void bench_parallel(const char* name, unsigned threads, size_t iters, F fn){
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> pool;
+    for(unsigned t=0;t<threads;++t)
+        pool.emplace_back([&fn, t, iters]{ for(size_t i=0;i<iters;++i) fn(t, i); });
+    for(auto &th: pool) th.join();
+    bench_report(name, threads*iters, t0);
+}
+
+int run_benchmarks(const string &dir, const Options &opt){
+    filesystem::current_path(dir);
+    printf("%-26s %10s %15s %17s\n", "benchmark", "iters", "total", "per op");
+
+    unique_ptr<App> app;
+    bench("load_all", 1, [&](size_t){ app.reset(new App(opt)); });
+    App &a = *app;
+    if(a.products.empty()){ cerr << "No data in " << dir << "\n"; return 1; }
+
+    mt19937_64 rng(7);
+    const size_t lookups = 1000000;
+    auto pick = [&](auto &vec, auto key){
+        vector<string> keys(lookups);
+        for(auto &k: keys) k = vec[rng()%vec.size()].*key;
+        return keys;
+    };
+
+    auto pkeys = pick(a.products, &Product::code);
+    bench("find_product", lookups, [&](size_t i){ if(!a.find_product(pkeys[i])) abort(); });
+    // The same lookups with latency recording forced on, for its cost.
+    bool was_on = metrics.enabled.exchange(true);
+    bench("find_product_timed", lookups, [&](size_t i){ if(!a.find_product(pkeys[i])) abort(); });
+    metrics.enabled = was_on;
+    if(!a.customers.empty()){
+        auto ckeys = pick(a.customers, &Customer::code);
+        bench("find_customer", lookups, [&](size_t i){ if(!a.find_customer(ckeys[i])) abort(); });
+    }
+    if(!a.invoices.empty()){
+        auto ikeys = pick(a.invoices, &Invoice::number);
+        bench("find_invoice", lookups, [&](size_t i){ if(!a.find_invoice(ikeys[i])) abort(); });
+        // Numbers never issued, answered from the month ranges without
+        // reading older months.
+        bench("find_invoice_miss", lookups/10, [&](size_t i){ if(a.find_invoice(to_string(LLONG_MAX-i))) abort(); });
+    }
+    if(!a.dispatches.empty()){
+        auto dkeys = pick(a.dispatches, &Dispatch::number);
+        bench("find_dispatch", lookups, [&](size_t i){ if(!a.find_dispatch(dkeys[i])) abort(); });
+    }
+
+    // Quantity fields as they appear in products.txt, read with stoll as
+    // the loaders used to and with parse_qty() as they do now.
+    vector<string> qtys(lookups);
+    for(auto &q: qtys) q = to_string(a.products[rng()%a.products.size()].qty);
+    volatile long long qsum = 0;
+    bench("parse_qty_stoll", qtys.size(), [&](size_t i){ qsum = qsum + stoll(qtys[i]); });
+    bench("parse_qty_from_chars", qtys.size(), [&](size_t i){
+        long long q = 0;
+        if(!parse_qty(qtys[i], q)) abort();
+        qsum = qsum + q;
+    });
+
+    // The first search builds the trigram index over every product.
+    volatile size_t hits = 0;
+    bench("search_index_build", 1, [&](size_t){ hits = hits + a.search_products("item", 1).size(); });
+    vector<string> queries(1000);
+    for(auto &q: queries) q = "item " + to_string(rng()%a.products.size());
+    bench("search_products", queries.size(), [&](size_t i){ hits = hits + a.search_products(queries[i], 20).size(); });
+    bench("search_products_common", 1000, [&](size_t){ hits = hits + a.search_products("synthetic", 20).size(); });
+    bench("search_products_short", 100, [&](size_t){ hits = hits + a.search_products("99", 20).size(); });
+    if(!a.customers.empty())
+        bench("search_customers", 1000, [&](size_t i){ hits = hits + a.search_customers(to_string(i) + " main", 20).size(); });
+
+    // End-to-end transactions, each with its own durable commit().
+    const size_t txns = 500;
+    vector<string> sales;
+    bench("create_invoice", txns, [&](size_t){
+        Invoice inv;
+        inv.type = "sale";
+        inv.date = today_str();
+        string customer = a.customers.empty() ? string() : a.customers[rng()%a.customers.size()].code;
+        vector<ItemLine> items;
+        for(int k=0;k<3;++k) items.push_back({a.products[rng()%a.products.size()].code, 1});
+        if(!a.apply_invoice(inv, customer, items).empty()) abort();
+        a.commit();
+        sales.push_back(inv.number);
+    });
+
+    size_t dispatched = 0;
+    bench("create_dispatch", txns, [&](size_t i){
+        Dispatch d;
+        d.invoice_number = sales[i];
+        d.date = today_str();
+        vector<ItemLine> items;
+        for(auto &it: a.find_invoice(sales[i])->items) items.push_back({it.product_code(), it.qty});
+        if(a.apply_dispatch(d, items).empty()) dispatched++;
+        a.commit();
+    });
+
+    // Several threads reserve random orders on a few hot products until
+    // the stock runs out. Every unit must end up either still in stock
+    // or in exactly one filled order.
+    unsigned nt = max(4u, thread::hardware_concurrency());
+    const size_t orders = 20000;
+    size_t hot = min<size_t>(a.products.size(), 8);
+    vector<long long> start(hot);
+    for(size_t k=0;k<hot;++k) start[k] = a.products[k].qty;
+    vector<vector<ItemSpan>> mix(nt);
+    for(auto &m: mix)
+        for(int j=0;j<256;++j){
+            vector<InvoiceItem> items;
+            for(int k=0, n=1+rng()%3; k<n; ++k)
+                items.emplace_back(a.products[rng()%hot].code, 1 + (long long)(rng()%5));
+            m.push_back(ItemSpan::of(items));
+        }
+    vector<atomic<long long>> taken(hot);
+    atomic<size_t> filled{0};
+    bench_parallel("reserve_stock_mt", nt, orders, [&](unsigned t, size_t i){
+        const ItemSpan &order = mix[t][i % mix[t].size()];
+        if(!a.reserve_stock(order).empty()) return;
+        filled++;
+        for(auto &it: order) taken[a.slot_of(*a.find_product(it.product))] += it.qty;
+    });
+    a.commit();
+    for(size_t k=0;k<hot;++k){
+        if(a.products[k].qty < 0 || a.products[k].qty != start[k] - taken[k]
+           || a.columns.qty[k] != a.products[k].qty){
+            fprintf(stderr, "stock of %s is %lld, expected %lld\n", a.products[k].code.c_str(),
+                    a.products[k].qty, start[k] - taken[k].load());
+            abort();
+        }
+    }
+
+    // Sessions committing at once share fsyncs; with a window the leader
+    // also waits for stragglers before flushing.
+    const size_t commits = 200;
+    vector<size_t> fsyncs;
+    for(unsigned us: {0u, 500u}){
+        Journal j;
+        j.path = "bench_journal.log";
+        j.window = chrono::microseconds(us);
+        j.reset();
+        string name = "journal_commit_mt/" + to_string(us) + "us";
+        bench_parallel(name.c_str(), nt, commits, [&](unsigned t, size_t i){
+            j.append('K', "C" + to_string(t) + ",P" + to_string(i) + ",1");
+            j.sync();
+        });
+        fsyncs.push_back(j.flushes);
+        j.close();
+        filesystem::remove(j.path);
+    }
+
+    // Reports are written to a discarding writer. The first inventory
+    // pass formats every row; after a sale only that row is redone.
+    BulkWriter sink(nullptr);
+    bench("consignment_by_product", 5, [&](size_t){ a.write_consignment_by_product(sink); });
+    bench("inventory_report", 3, [&](size_t){ a.write_inventory_report(sink); });
+    bench("inventory_after_sale", 100, [&](size_t){
+        a.adjust_stock(a.products[rng()%a.products.size()], -1);
+        a.write_inventory_report(sink);
+    });
+    a.commit();
+    volatile long long units = 0;
+    bench("total_stock", 100, [&](size_t){ units = units + a.columns.total_stock(); });
+
+    // Ordered listings: the first page files every slot; later pages seek
+    // from their cursor, and a sale refiles only the product it touched.
+    bench("ordered_index_build", 1, [&](size_t){ units = units + a.columns.page_by_name(nullptr, 40).size(); });
+    auto mid = a.columns.page_by_name(nullptr, a.columns.size()/2 + 1);
+    OrderedIndex<string>::Entry at = mid.empty() ? OrderedIndex<string>::Entry() : mid.back();
+    bench("name_page_at_cursor", 1000, [&](size_t){ units = units + a.columns.page_by_name(&at, 40).size(); });
+    a.columns.page_by_qty(nullptr, 1);
+    bench("lowest_stock_after_sale", 1000, [&](size_t){
+        a.adjust_stock(a.products[rng()%a.products.size()], -1);
+        units = units + a.columns.page_by_qty(nullptr, 20).size();
+    });
+    a.commit();
+
+    // A year of history: the first pass reads the months in from disk,
+    // later ones only walk the records of those months.
+    size_t months_before = a.loaded_months.size();
+    bench("sales_by_product_cold", 1, [&](size_t){ units = units + a.sales_by_product("2022-01-01", "2022-12-31").size(); });
+    bench("sales_by_product_warm", 10, [&](size_t){ units = units + a.sales_by_product("2022-01-01", "2022-12-31").size(); });
+
+    // A supplier catalog a tenth the size of the table, imported from CSV
+    // and saved once; the import reports its own rows/sec.
+    {
+        BulkWriter out("bench_import.csv");
+        out << "code,name,description,qty\n";
+        for(size_t i=0, n=max<size_t>(1000, a.products.size()/10); i<n; ++i)
+            out << "S" << (long long)i << ",Supplier item " << (long long)i << ",\"Bulk, pack of "
+                << (long long)(i%12) << "\"," << (long long)(i%997) << "\n";
+    }
+    bench("import_products", 1, [&](size_t){ a.import_table("products", "bench_import.csv"); });
+    filesystem::remove("bench_import.csv");
+
+    // Discontinuing 30% of the products one by one: each delete leaves a
+    // tombstone, and passing a quarter of the table compacts it once.
+    vector<string> gone;
+    for(auto &p: a.products) if(rng()%10<3) gone.push_back(p.code);
+    size_t before = a.products.size();
+    bench("delete_products", gone.size(), [&](size_t i){
+        if(a.erase_product(gone[i])) a.log_product_delete(gone[i]);
+    });
+    a.commit();
+    bench("save_all", 1, [&](size_t){ a.save_all(); });
+
+    printf("(%zu of %zu benchmark dispatches had enough stock)\n", dispatched, txns);
+    printf("(%zu of %zu concurrent reservations filled on %u threads; no stock lost or oversold)\n",
+           filled.load(), nt*orders, nt);
+    printf("(%zu and %zu fsyncs for %zu concurrent journal commits, without and with a window)\n",
+           fsyncs[0], fsyncs[1], nt*commits);
+    printf("(%zu history months in memory at startup, %zu after the sales queries, %zu on disk)\n",
+           months_before, a.loaded_months.size(), a.history_months.size());
+    printf("(%zu of %zu products deleted, %zu slots left after compaction)\n",
+           gone.size(), before, a.products.size());
+    return 0;
+}
+
+/* ---------- Self-test ---------- */
+
+/*
+  --selftest feeds random lines to the vector tokenizer and to the scalar
+  one and stops at the first line they split differently. Lines are built
+  from quotes, delimiters and blanks, with lengths around the 64-byte
+  block size, so quotes left open across a block edge are covered.
+*/
+int run_selftest(){
+    const char alphabet[] = "ab,;\"\" \t\r\n";
+    mt19937_64 rng(1);
+    vector<string_view> got, want;
+    size_t cases = 200000;
+    for(size_t i=0;i<cases;++i){
+        size_t len = rng()%4 ? rng()%200 : 64*(1+rng()%4) + rng()%3 - 1;
+        string line(len, ' ');
+        for(char &c: line) c = alphabet[rng()%(sizeof(alphabet)-1)];
+        char delim = rng()%2 ? ',' : ';';
+        split_view(line, delim, got);
+        split_view_scalar(line, delim, want);
+        if(got!=want){
+            cerr << "split_view differs from the scalar tokenizer on (delimiter '" << delim << "'):\n"
+                 << json_quote(line) << "\n";
+            return 1;
+        }
+    }
+    cout << cases << " lines split alike by the vector and scalar tokenizers.\n";
+    return 0;
+}
+
 /* ---------- main ---------- */
 
-int main(){
+void usage(){
+    cout << "Usage: warehouse [--binary] [--lenient] [--no-journal] [--threads N] [--recent-months N] [--metrics FILE] [--batch commands.ndjson]\n"
+         << "       warehouse --txt-to-bin | --bin-to-txt\n"
+         << "       warehouse --generate DIR ROWS\n"
+         << "       warehouse --selftest\n"
+         << "       warehouse [--binary] [--threads N] --bench DIR\n"
+         << "       warehouse [--binary] [--no-journal] [--threads N] [--commit-window USEC] --serve SOCKET\n"
+         << "       warehouse [--binary] [--lenient] --export inventory|customers|consignment csv|json FILE\n"
+         << "       warehouse [--binary] [--lenient] [--threads N] --import products|customers FILE\n";
+}
+
+int run(int argc, char** argv){
+    Options opt;
+    // Options may come in any order, so they are all read before the
+    // mode (the console unless one is named) starts.
+    string mode;
+    vector<string> args;
+    auto pick = [&](const string &m, int &i, int n){
+        if(!mode.empty() && mode!=m) return false;
+        mode = m;
+        args.assign(argv+i+1, argv+i+1+n);
+        i += n;
+        return true;
+    };
+    for(int i=1;i<argc;++i){
+        string a = argv[i];
+        bool ok = true;
+        if(a=="--binary") opt.binary = true;
+        else if(a=="--lenient") opt.lenient = true;
+        else if(a=="--no-journal") opt.journal = false;
+        else if(a=="--threads" && i+1<argc) opt.threads = (unsigned)max(0L, atol(argv[++i]));
+        else if(a=="--recent-months" && i+1<argc) opt.recent_months = (unsigned)max(0L, atol(argv[++i]));
+        else if(a=="--commit-window" && i+1<argc) opt.commit_window_us = (unsigned)max(0L, atol(argv[++i]));
+        else if(a=="--metrics" && i+1<argc){
+            metrics.path = argv[++i];
+            metrics.enabled = true;
+        }
+        else if((a=="--batch" || a=="--serve" || a=="--bench") && i+1<argc) ok = pick(a, i, 1);
+        else if((a=="--generate" || a=="--import") && i+2<argc) ok = pick(a, i, 2);
+        else if(a=="--export" && i+3<argc) ok = pick(a, i, 3);
+        else if(a=="--selftest" || a=="--txt-to-bin" || a=="--bin-to-txt") ok = pick(a, i, 0);
+        else ok = false;
+        if(!ok){ usage(); return 1; }
+    }
+
+    if(metrics.enabled)
+        atexit([]{
+            string err = metrics.dump();
+            if(!err.empty()) cerr << err << "\n";
+        });
+
+    if(mode=="--generate"){
+        Generator(atoll(args[1].c_str())).write(args[0]);
+        cout << "Data set written to " << args[0] << ".\n";
+        return 0;
+    }
+    if(mode=="--bench") return run_benchmarks(args[0], opt);
+    if(mode=="--selftest") return run_selftest();
+    if(mode=="--export" || mode=="--import"){
+        App app(opt);
+        string err;
+        try{
+            err = mode=="--export" ? app.export_report(args[0], args[1], args[2])
+                                   : app.import_table(args[0], args[1]);
+        }
+        catch(const exception &e){ err = e.what(); }
+        if(!err.empty()){ cerr << err << "\n"; return 1; }
+        return 0;
+    }
+    if(mode=="--txt-to-bin" || mode=="--bin-to-txt"){
+        FileManager fm;
+        fm.lenient = opt.lenient;
+        fm.threads = opt.threads;
+        fm.convert_snapshots(mode=="--txt-to-bin");
+        cout << "Snapshots converted.\n";
+        return 0;
+    }
+
+    if(mode=="--batch"){
+        App app(opt);
+        return app.run_batch(args[0]) ? 2 : 0;
+    }
+
+    if(mode=="--serve"){
+#if defined(_WIN32)
+        cerr << "--serve needs Unix-domain sockets, which this build does not have.\n";
+        return 1;
+#else
+        App app(opt);
+        return Server(app, args[0]).run();
+#endif
+    }
+
     cin.clear();
     cin.ignore(numeric_limits<streamsize>::max(), '\n');
 
-    App app;
+    App app(opt);
     app.login_screen();
     app.main_menu();
     return 0;
 }
+
+// A data file that does not parse, outside --lenient, ends up here.
+int main(int argc, char** argv){
+    try{ return run(argc, argv); }
+    catch(const exception &e){ cerr << e.what() << "\n"; return 1; }
+}